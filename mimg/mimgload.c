@@ -97,7 +97,7 @@ int hasMMap() {
  * available range of physical (32 bit) addresses.
  */
 int mmapAvailable(struct MultibootMMap* mmap) {
-  return (mmap->type=1)
+  return (mmap->type==1)
       && (mmap->baseHi==0) && (mmap->lenHi==0)
       && (mmap->baseLo+mmap->lenLo-1 >= mmap->baseLo);
 }
@@ -155,6 +155,7 @@ static inline void returnToContext(struct Context* ctxt) {
 #define IPC_SetFrom(tcb)               (tcb    ->context.regs.eax)
 
 #define Unmap_Control                  (current->context.regs.eax)
+#define Unmap_Status                   (current->context.regs.edx)
 
 #define SpaceControl_SpaceSpecifier    (current->context.regs.eax)
 #define SpaceControl_Control           (current->context.regs.ecx)
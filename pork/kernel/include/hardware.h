@@ -34,33 +34,159 @@ static inline byte inb(short port) {
   return b;
 }
 
-static inline void enableIRQ(byte irq) {
-  if (irq&8) {
-    outb(0xa1, ~(1<<(irq&7)) & inb(0xa1));
+/*-------------------------------------------------------------------------
+ * Interrupt controllers:
+ *
+ * Hardware IRQs are delivered either by the legacy pair of 8259 PICs or,
+ * if initInterrupts() finds them at boot, by an IOAPIC and the local APIC.
+ * Either way, irqMasks holds a copy of the interrupt masks (bit n set =>
+ * IRQ n is masked), so we never have to read them back from the hardware.
+ * With the APIC, masking an IRQ is a write to its IOAPIC redirection entry
+ * and acknowledging it is a single write to the local APIC's (memory
+ * mapped) EOI register, instead of a series of slow port I/O instructions.
+ */
+extern unsigned           irqMasks;          // Shadow of interrupt masks
+extern volatile unsigned* lapic;             // Local APIC, or 0 => use PICs
+extern volatile unsigned* ioapic;            // IOAPIC registers
+extern unsigned           irqRedir[NUMIRQs]; // IOAPIC redirection for IRQs
+extern byte               irqPin[NUMIRQs];   // IOAPIC input, or NOPIN
+extern void               initInterrupts(void);
+
+#define NOPIN         0xff        // IRQ not connected to the IOAPIC
+#define LAPIC_ID      (0x20>>2)   // Indices of local APIC registers
+#define LAPIC_TPR     (0x80>>2)
+#define LAPIC_EOI     (0xb0>>2)
+#define LAPIC_SVR     (0xf0>>2)
+#define LAPIC_IRR     (0x200>>2)
+#define IOAPIC_VER    0x01        // IOAPIC registers
+#define IOAPIC_REDIR  0x10
+#define IOAPIC_MASKED (1<<16)     // Mask bit in a redirection entry
+
+static inline void ioapicWrite(unsigned reg, unsigned v) {
+  ioapic[0] = reg;  // IOREGSEL
+  ioapic[4] = v;    // IOWIN
+}
+
+static inline unsigned ioapicRead(unsigned reg) {
+  ioapic[0] = reg;
+  return ioapic[4];
+}
+
+/* Copy the shadow mask for the given IRQ to the interrupt controller.
+ */
+static inline void setMask(byte irq) {
+  if (lapic) {
+    if (irqPin[irq]!=NOPIN) {
+      ioapicWrite(IOAPIC_REDIR + 2*irqPin[irq],
+                  irqRedir[irq] | (irqMasks & (1<<irq) ? IOAPIC_MASKED : 0));
+    }
+  } else if (irq&8) {
+    outb(0xa1, irqMasks>>8);
   } else {
-    outb(0x21, ~(1<<(irq&7)) & inb(0x21));
+    outb(0x21, irqMasks);
   }
 }
 
+static inline void enableIRQ(byte irq) {
+  irqMasks &= ~(1<<irq);
+  setMask(irq);
+}
+
 static inline void disableIRQ(byte irq) {
-  if (irq&8) {
-    outb(0xa1, (1<<(irq&7)) | inb(0xa1));
-  } else {
-    outb(0x21, (1<<(irq&7)) | inb(0x21));
-  }
+  irqMasks |= (1<<irq);
+  setMask(irq);
 }
 
-static inline void maskAckIRQ(byte irq) {
-  if (irq&8) {
-    outb(0xa1, (1<<(irq&7)) | inb(0xa1));
+/* Acknowledge an interrupt, without changing its mask.
+ */
+static inline void ackIRQ(byte irq) {
+  if (lapic) {
+    lapic[LAPIC_EOI] = 0;
+  } else if (irq&8) {
     outb(0xa0, 0x60|(irq&7)); // EOI to PIC2
     outb(0x20, 0x62);         // EOI for IRQ2 on PIC1
   } else {
-    outb(0x21, (1<<(irq&7)) | inb(0x21));
     outb(0x20, 0x60|(irq&7)); // EOI to PIC1
   }
 }
 
+static inline void maskAckIRQ(byte irq) {
+  disableIRQ(irq);
+  ackIRQ(irq);
+}
+
+/* Test for an interrupt request that is waiting to be serviced.  With the
+ * APIC, masked IRQs are never delivered, so we need only look for one of
+ * our vectors in the local APIC's interrupt request register.  With the
+ * PICs, we read the interrupt request registers (OCW3 = 0x0a) of both and
+ * ignore any requests for IRQs that are masked.  IRQ2 is the cascade from
+ * PIC2, and so only counts if PIC2 has an unmasked request of its own.
+ */
+static inline bool pendingIRQ() {
+  if (lapic) {
+    unsigned irr = lapic[LAPIC_IRR + 4*(IRQBASE>>5)] >> (IRQBASE&31);
+    return (irr & ((1<<NUMIRQs)-1)) != 0;
+  }
+  outb(0x20, 0x0a);
+  outb(0xa0, 0x0a);
+  unsigned irr = inb(0x20) | (inb(0xa0)<<8);
+  return (irr & ~(irqMasks | (1<<2))) != 0;
+}
+
+static inline void cpuid(unsigned leaf, unsigned* a, unsigned* d) {
+  unsigned b, c;
+  asm volatile("cpuid\n" : "=a"(*a), "=b"(b), "=c"(c), "=d"(*d) : "a"(leaf));
+}
+
+static inline unsigned long long rdmsr(unsigned msr) {
+  unsigned long long v;
+  asm volatile("rdmsr\n" : "=A"(v) : "c"(msr));
+  return v;
+}
+
+static inline void wrmsr(unsigned msr, unsigned long long v) {
+  asm volatile("wrmsr\n" : : "c"(msr), "A"(v));
+}
+
+static inline unsigned getCR0() {
+  unsigned v;
+  asm volatile("movl %%cr0, %0\n" : "=r"(v));
+  return v;
+}
+
+static inline void setCR0(unsigned v) {
+  asm volatile("movl %0, %%cr0\n" : : "r"(v));
+}
+
+static inline unsigned getCR4() {
+  unsigned v;
+  asm volatile("movl %%cr4, %0\n" : "=r"(v));
+  return v;
+}
+
+static inline void setCR4(unsigned v) {
+  asm volatile("movl %0, %%cr4\n" : : "r"(v));
+}
+
+#define CR0_MP  (1<<1)    // Monitor coprocessor (wait/fwait check TS)
+#define CR0_EM  (1<<2)    // Emulate FPU
+#define CR0_TS  (1<<3)    // Task switched (FPU state belongs elsewhere)
+#define CR0_NE  (1<<5)    // Native FPU error reporting (#MF)
+#define CR4_OSFXSR     (1<<9)   // Enable fxsave/fxrstor and SSE
+#define CR4_OSXMMEXCPT (1<<10)  // Enable SIMD floating point exceptions
+
+static inline void clts() {
+  asm volatile("clts\n");
+}
+
+static inline void fxsave(void* area) {
+  asm volatile("fxsave (%0)\n" : : "r"(area) : "memory");
+}
+
+static inline void fxrstor(void* area) {
+  asm volatile("fxrstor (%0)\n" : : "r"(area) : "memory");
+}
+
 #define PIT_INTERVAL  ((1193182 + (HZ/2)) / HZ)
 
 static inline void startTimer() {
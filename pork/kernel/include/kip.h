@@ -27,21 +27,45 @@
 
 #define RESERVED          0
 
-#define REALPHYSMAP       (512<<20)     // Physical mapped to kernel
-#define PHYSMAP           (32<<20)      // Physical mapped to kernel
+#define REALPHYSMAP       (512<<20)     // Max physical mapped to kernel
+#define PHYSMAP           (32<<20)      // Physical mapped to kernel at boot
 #define UTCBPTR           0xfffff000    // Virtual address for utcb pointer
+#define TCBSPACE          0xe0000000    // Virtual address for TCB array
+#define IOSPACE           0xe1000000    // Virtual address for kernel devices
 
-#define PERMS_KERNELSPACE 0x83          // present, write, supervisor, superpg
+#define PERMS_KERNELSPACE 0x183         // present, write, supervisor, superpg,
+                                        // global
+#define PERMS_KERNEL_RO   0x101         // present,        supervisor, global
+#define PERMS_KERNEL_RW   0x103         // present, write, supervisor, global
+#define PERMS_KERNEL_IO   0x11b         // present, write, supervisor, global,
+                                        // uncached
 #define PERMS_USER_RO     0x05          // present,        user level
 #define PERMS_USER_RW     0x07          // present, write, user level
 #define PERMS_SUPERPAGE   0x80          //                             superpg
+#define PERMS_GLOBAL      0x100         // global (not flushed by cr3 loads)
+#define PERMS_PROMOTED    0x200         // (available bit) promoted superpg
+#define PERMS_SHARED      0x400         // (available bit) shared page table
 
 #define NUMIRQs           16
 #define TIMERIRQ          0             // IRQ number for the system timer
+#define IRQBASE           0x20          // Interrupt vector for IRQ 0
 #define HZ                100           // Frequency of timer interrupts
 
 #define PAGESIZE          12
-#define SUPERSIZE         22
+#ifdef PAE                              // PAE paging (build with -DPAE):
+#define SUPERSIZE         21            //  2MB super pages
+#define PTBITS            9             //  512 entries per page table
+#define PTESIZE           3             //  8 bytes per page table entry
+#else                                   // Classic 32 bit paging:
+#define SUPERSIZE         22            //  4MB super pages
+#define PTBITS            10            //  1024 entries per page table
+#define PTESIZE           2             //  4 bytes per page table entry
+#endif
+#define PDENTRIES         (1<<(32-SUPERSIZE)) // Total page directory slots
+
+#define NUMSMALL          16            // Number of small space slots, each
+                                        // one superpage, just below the
+#define SMALLSPACES       (KERNEL_SPACE-(NUMSMALL<<SUPERSIZE)) // kernel
 
 #define R                 (4)
 #define W                 (2)
@@ -55,6 +79,7 @@
 #define USERBASE          48            // First user thread id
 #define SYSTEMBASE        NUMIRQs       // First kernel thread id
 #define THREADBITS        17            // Number of bits in thread id
+#define TCBSIZE           7             // Each TCB occupies 128 bytes
 #define VERSIONBITS       14            // Number of bits in thread ver
 #define PRIOBITS          8             // Priorities are 8 bit values
 #define PRIORITIES        (1<<PRIOBITS) // Total number of priorities
@@ -77,6 +102,8 @@
 #define INT_PROCCONTROL   0x77
 #define INT_MEMCONTROL    0x78
 #define INT_SYSTEMCLOCK   0x79
+#define INT_IDLE          0x7f          // (kernel only: idle thread work)
+#define INT_SPURIOUS      0xff          // (local APIC spurious interrupts)
 
 #endif
 /*-----------------------------------------------------------------------*/
@@ -23,20 +23,39 @@
  *
  * Functions that allocate memory pages have names of the form xxxN, where
  * xxxx is a name for the function and N is an upper bound on the number of
- * pages that might be allocated during the function call.  The behavior of
- * a call to xxxxN(...) when there are fewer than N free pages is undefined.
- * Instead, callers are expected to use availPages(N) or to pass on the
- * requirement for pages in their own names.  (e.g., f2() may call g1() upto
- * two times.)  With a richer type system, we could capture this information
- * using types instead of a naming convention ...
+ * pages that might be allocated during the function call.  Every such
+ * function takes a Reservation as its first argument, and draws all of
+ * the pages that it allocates from that reservation.  Callers obtain a
+ * reservation for N pages, before they make any changes, using
+ * reservePages(r, N), which fails (leaving nothing reserved) if there
+ * are not enough free pages; this is the only point at which an
+ * operation can run out of memory.  Once the operation is complete,
+ * releasePages(r) returns any pages that were reserved but not used.
+ * Callers can also pass on the requirement for pages in their own names.
+ * (e.g., f2() may call g1() upto two times.)  With a richer type system,
+ * we could capture this information using types instead of a naming
+ * convention ...
  *-----------------------------------------------------------------------*/
 #ifndef MEMORY_H
 #define MEMORY_H
 
+struct Reservation {
+  unsigned pages;       // Number of reserved pages that have not been used
+};
+
 extern void     initMemory(void);
-extern void*    allocPage1(void);
+extern bool     reservePages(struct Reservation* r, unsigned n);
+extern void     releasePages(struct Reservation* r);
+extern void     cancelReservations(void);
+extern void*    allocPage1(struct Reservation* r);
 extern void     freePage(void* p);
-extern bool     availPages(unsigned n);
+extern bool     kernelMemory(unsigned phys);
+extern bool     kernelMemoryIn(unsigned lo, unsigned hi);
+extern bool     conventionalRange(unsigned lo, unsigned hi);
+extern bool     donatable(unsigned phys);
+extern void     donatePage(unsigned phys);
+extern unsigned reclaimPages(unsigned lo, unsigned hi);
+extern unsigned physTop;
 
 struct Server {
   unsigned sp;
@@ -39,14 +39,26 @@ static inline unsigned max(unsigned a, unsigned b) { return (a<b) ? b : a; }
 
 typedef unsigned int  bool;
 typedef unsigned char byte;
+#ifdef PAE
+typedef unsigned long long Pte;         /* Page directory/table entries  */
+#else
+typedef unsigned      Pte;
+#endif
 extern  byte          Kip[];
 extern  byte          KipEnd[];
 extern  unsigned      esp0;
+extern  Pte           initPdir[];
+#ifdef PAE
+extern  Pte           initPdpt[];
+#endif
 extern  unsigned*     utcbptr;
 
 extern void        abortIf(bool cond, char* msg);
 static inline void ASSERT(unsigned cond, char* msg) { abortIf(!cond, msg); }
 extern void        halt(void);
+extern void        idle(void);
+extern void        allowRestart(bool allow);
+extern void        preemptionPoint(void);
 
 #endif
 /*-----------------------------------------------------------------------*/
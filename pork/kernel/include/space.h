@@ -66,28 +66,58 @@ static inline Fpage trimFpage(Fpage big, unsigned base, Fpage small) {
  * Address Spaces:
  *-----------------------------------------------------------------------*/
 struct Space;
+struct Reservation;
 
 extern struct Space* sigma0Space;
 extern struct Space* rootSpace;
+extern struct Space* kernelSpace;
 
 extern void          initSpaces(void);
 extern bool          privileged(struct Space* space);
-extern struct Space* allocSpace1(void);
+extern bool          userMapped(unsigned addr);
+extern unsigned      spaceASID(struct Space* space);
+extern bool          availableASID(void);
+extern struct Space* allocSpace1(struct Reservation* r);
 extern void          enterSpace(struct Space* space);
 extern void          configureSpace(struct Space* space,
                                     Fpage kipArea, Fpage utcbArea);
 extern bool          configuredSpace(struct Space* space);
 extern unsigned      kipStart(struct Space* space);
 extern bool          validUtcb(struct Space* space, unsigned utcbAddr);
-extern void*         allocUtcb4(struct Space* space, unsigned utcbAddr);
+extern void*         allocUtcb7(struct Reservation* r,
+                                   struct Space* space, unsigned utcbAddr);
 extern bool          activeSpace(struct Space* space);
 extern void          switchSpace(struct Space* space);
 extern void          refreshSpace(void);
+extern void          setSmall(struct Space* space, bool small);
+extern bool          growSpace(struct Space* space);
+extern unsigned      spaceBase(struct Space* space);
 extern unsigned      sigma0map(unsigned addr);
-extern void          map2(struct Space* sendspace, Fpage sendfp,
+extern bool          mappedRange(struct Space* space, unsigned lo, unsigned hi);
+extern bool          refillSpace(struct Space* space, unsigned addr);
+extern unsigned      donateFpage(Fpage fp);
+extern bool          revokeFpage(struct Space* space, Fpage fp, bool own,
+                                 unsigned* status);
+extern void          map2(struct Reservation* r,
+                          struct Space* sendspace, Fpage sendfp,
                           unsigned sendbase,
                           struct Space* recvspace, Fpage recvfp);
+extern bool          cloneSpace(struct Space* dest,
+                                struct Space* src, Fpage fp);
 extern void          exitSpace(struct Space* space, void* utcb);
+extern void          settleSpace(struct Space* space, unsigned n);
+extern bool          reclaimSpaces(void);
+
+extern void          allocTCBPage1(struct Reservation* r, void* addr);
+extern void          freeTCBPage(void* addr);
+
+extern bool          reserveSpace(struct Reservation* r,
+                                  struct Space* space, unsigned n);
+extern void          chargeSpace(struct Space* space, unsigned bytes);
+extern bool          tryChargeSpace(struct Space* space, unsigned bytes);
+extern void          refundSpace(struct Space* space, unsigned bytes);
+extern unsigned      getQuota(struct Space* space);
+extern void          setQuota(struct Space* space, unsigned quota);
 
 #endif
 /*-----------------------------------------------------------------------*/
@@ -72,25 +72,33 @@ struct UTCB {
 
 /*-------------------------------------------------------------------------
  * Kernel thread control blocks (TCBs):
+ *
+ * Each TCB fills exactly two cache lines.  The first holds the fields
+ * that an IPC reads or writes for the partner thread (including the
+ * registers that carry IPC parameters and results), so that finding
+ * and checking a partner, and transferring a message to it, usually
+ * touches only that line.  The second holds the rest of the saved user
+ * context, which is only needed when the thread itself enters or leaves
+ * the kernel, followed by fields that are used less often.
  *-----------------------------------------------------------------------*/
 struct TCB {
   ThreadId       tid;           // this thread's id and version number
   byte           status;        // thread status
   byte           prio;          // thread priority
-  byte           padding;
+  byte           fpu;           // 1 => thread has an FPU save area
   byte           count;	        // for gc of TCBs in kernel memory
+  struct Space*  space;         // pointer to this thread's addr space
   struct UTCB*   utcb;          // pointer to this thread's utcb
-  unsigned       vutcb;         // virtual address of utcb
 
   struct TCB*    sendqueue;     // list of threads waiting to send
   struct TCB*    receiver;      // pointer to owner of sendqueue
   struct TCB*    prev;
   struct TCB*    next;
 
-  struct Space*  space;         // pointer to this thread's addr space
-  unsigned       faultCode;     // exception number or page fault addr
   struct Context context;       // context of user level process
 
+  unsigned       vutcb;         // virtual address of utcb
+  unsigned       faultCode;     // exception number or page fault addr
   ThreadId       scheduler;     // scheduling parameters
   unsigned       timeslice;
   unsigned       timeleft;
@@ -101,7 +109,9 @@ extern struct TCB* current;	// Points to the TCB of the current thread
 
 extern void        initTCBs(void);
 extern void        initScheduling(void);
-extern struct TCB* allocTCB1(ThreadId tid, struct Space* space, ThreadId scheduler);
+extern void        initFPU(void);
+extern struct TCB* allocTCB1(struct Reservation* r, ThreadId tid,
+                             struct Space* space, ThreadId scheduler);
 extern struct TCB* existsTCB(unsigned threadNo);
 extern struct TCB* findTCB(ThreadId tid);
 extern struct TCB* insertTCB(struct TCB* queue, struct TCB* tcb);
@@ -111,6 +121,9 @@ extern void        removeRunnable(struct TCB* tcb);
 extern void        haltThread(struct TCB* tcb);
 extern void        resumeThread(struct TCB* tcb);
 extern void        reschedule(void);
+extern void        switchIfHigher(struct TCB* tcb);
+extern bool        claimFPU(void);
+extern void        releaseFPU(struct TCB* tcb);
 static inline void resume(void) { returnToContext(&(current->context)); }
 
 #define retError(result, code)  do { result = 0; \
@@ -0,0 +1,258 @@
+/*
+    Copyright 2014-2018 Mark P Jones, Portland State University
+
+    This file is part of CEMLaBS/LLP Demos and Lab Exercises.
+
+    CEMLaBS/LLP Demos and Lab Exercises is free software: you can
+    redistribute it and/or modify it under the terms of the GNU General
+    Public License as published by the Free Software Foundation, either
+    version 3 of the License, or (at your option) any later version.
+
+    CEMLaBS/LLP Demos and Lab Exercises is distributed in the hope that
+    it will be useful, but WITHOUT ANY WARRANTY; without even the
+    implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+    PURPOSE.  See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CEMLaBS/LLP Demos and Lab Exercises.  If not, see
+    <https://www.gnu.org/licenses/>.
+*/
+/*-------------------------------------------------------------------------
+ * Interrupt controller initialization:
+ * Mark P Jones, Portland State University
+ *-----------------------------------------------------------------------*/
+#include "pork.h"
+#include "memory.h"
+#include "hardware.h"
+
+#define DEBUG(cmd)   /*cmd*/
+
+unsigned           irqMasks = 0xfffb;  // Initial PIC masks, set by boot.S
+volatile unsigned* lapic    = 0;
+volatile unsigned* ioapic   = 0;
+unsigned           irqRedir[NUMIRQs];
+byte               irqPin[NUMIRQs];
+
+/*-------------------------------------------------------------------------
+ * MultiProcessor Specification tables:
+ *
+ * We find the IOAPIC, and the IOAPIC input for each ISA IRQ, from the
+ * tables that the BIOS provides for the Intel MultiProcessor Specification
+ * (version 1.4).  These are usually stored in the BIOS area, within the
+ * part of physical memory that the kernel can already see at boot, and are
+ * much simpler to read than the equivalent ACPI tables.  If they cannot be
+ * found, or if they describe one of the "default configurations" without
+ * giving the details explicitly, then we just continue to use the PICs.
+ *-----------------------------------------------------------------------*/
+struct MPFloat {                // MP floating pointer structure:
+  char           sig[4];        //   "_MP_"
+  unsigned       config;        //   physical address of config table
+  byte           length;        //   length in 16 byte units
+  byte           rev;
+  byte           checksum;
+  byte           features[5];   //   [0]: default config, [1]&0x80: IMCR
+};
+
+struct MPConfig {               // MP configuration table header:
+  char           sig[4];        //   "PCMP"
+  unsigned short length;        //   length of base table
+  byte           rev;
+  byte           checksum;
+  char           oemProduct[20];
+  unsigned       oemTable;
+  unsigned short oemSize;
+  unsigned short entries;       //   number of entries in base table
+  unsigned       lapic;         //   physical address of local APIC
+  unsigned short extLength;
+  byte           extChecksum;
+  byte           reserved;
+};
+
+#define MP_PROCESSOR 0          // Configuration table entry types
+#define MP_BUS       1
+#define MP_IOAPIC    2
+#define MP_IOINT     3
+#define MP_LOCALINT  4
+
+static bool checksum(byte* p, unsigned len) {
+  byte sum = 0;
+  while (len-- > 0) {
+    sum += *p++;
+  }
+  return sum==0;
+}
+
+/*-------------------------------------------------------------------------
+ * Search for an MP floating pointer structure in the given range of
+ * physical memory, returning a null pointer if there is none.
+ */
+static struct MPFloat* searchMP(unsigned lo, unsigned len) {
+  for (unsigned phys=lo; phys<lo+len; phys+=sizeof(struct MPFloat)) {
+    struct MPFloat* mp = fromPhys(struct MPFloat*, phys);
+    if (mp->sig[0]=='_' && mp->sig[1]=='M' && mp->sig[2]=='P'
+     && mp->sig[3]=='_' && mp->length==1
+     && checksum((byte*)mp, sizeof(struct MPFloat))) {
+      return mp;
+    }
+  }
+  return 0;
+}
+
+/*-------------------------------------------------------------------------
+ * Find the MP floating pointer structure: in the first KB of the extended
+ * BIOS data area, in the last KB of base memory, or in the BIOS ROM.
+ */
+static struct MPFloat* findMP() {
+  unsigned        ebda = (*fromPhys(unsigned short*, 0x40e))<<4;
+  unsigned        base = (*fromPhys(unsigned short*, 0x413))<<10;
+  struct MPFloat* mp   = 0;
+  if (ebda) {
+    mp = searchMP(ebda, 1024);
+  }
+  if (!mp && base>=1024) {
+    mp = searchMP(base-1024, 1024);
+  }
+  return mp ? mp : searchMP(0xf0000, 0x10000);
+}
+
+/*-------------------------------------------------------------------------
+ * Read the MP configuration table, setting irqPin and irqRedir for each
+ * ISA IRQ that is connected to the (first) IOAPIC, and returning the
+ * physical address of the IOAPIC, or zero if the table is not usable.
+ */
+static unsigned readMPConfig(struct MPConfig* cfg) {
+  unsigned isa[256/32];       // Bitmap of ISA bus ids
+  unsigned ioapicId   = 0;
+  unsigned ioapicPhys = 0;
+  byte*    p          = (byte*)(cfg+1);
+  byte*    end        = (byte*)cfg + cfg->length;
+
+  for (unsigned i=0; i<256/32; i++) {
+    isa[i] = 0;
+  }
+  for (unsigned i=0; i<NUMIRQs; i++) {
+    irqPin[i] = NOPIN;
+  }
+
+  // The specification requires entries to be sorted by type, so we will
+  // have seen all of the buses and IOAPICs before any interrupt entries.
+  for (unsigned n=0; n<cfg->entries && p<end; n++) {
+    switch (p[0]) {
+      case MP_PROCESSOR:
+        p += 20;
+        continue;
+
+      case MP_BUS:
+        if (p[2]=='I' && p[3]=='S' && p[4]=='A' && p[5]==' ') {
+          isa[p[1]>>5] |= 1<<(p[1]&31);
+        }
+        break;
+
+      case MP_IOAPIC:
+        if ((p[3]&1) && !ioapicPhys) {            // First enabled IOAPIC
+          ioapicId   = p[1];
+          ioapicPhys = *(unsigned*)(p+4);
+        }
+        break;
+
+      case MP_IOINT: {
+        unsigned flags = *(unsigned short*)(p+2);
+        unsigned bus   = p[4];
+        unsigned irq   = p[5];
+        if (p[1]==0                               // Vectored interrupt
+         && (isa[bus>>5] & (1<<(bus&31)))
+         && irq<NUMIRQs
+         && ioapicPhys && (p[6]==ioapicId || p[6]==0xff)) {
+          irqPin[irq]   = p[7];
+          irqRedir[irq] = (IRQBASE + irq)
+                        | (((flags&3)==3)      ? (1<<13) : 0)  // Active low
+                        | ((((flags>>2)&3)==3) ? (1<<15) : 0); // Level
+        }
+        break;
+      }
+
+      case MP_LOCALINT:
+        break;
+
+      default:                                    // Unknown entry type
+        return 0;
+    }
+    p += 8;
+  }
+  return (irqPin[TIMERIRQ]==NOPIN) ? 0 : ioapicPhys;
+}
+
+/*-------------------------------------------------------------------------
+ * Switch from the PICs to the local APIC and IOAPIC, if they are present
+ * and described by MP tables that we can read.  This must be called
+ * before the first address space is created, because it adds the device
+ * mappings at IOSPACE to the kernel's part of the initial page directory.
+ */
+void initInterrupts() {
+  unsigned eax, edx;
+  cpuid(1, &eax, &edx);
+  if (!(edx & (1<<9))) {                          // Local APIC present?
+    return;
+  }
+  unsigned long long apicBase = rdmsr(0x1b);      // IA32_APIC_BASE
+  if (!(apicBase & (1<<11)) || (apicBase>>32)) {  // Enabled, below 4GB?
+    return;
+  }
+
+  struct MPFloat* mp = findMP();
+  if (!mp || mp->features[0] || !mp->config
+   || mp->config+sizeof(struct MPConfig)>physTop) {
+    return;
+  }
+  struct MPConfig* cfg = fromPhys(struct MPConfig*, mp->config);
+  if (cfg->sig[0]!='P' || cfg->sig[1]!='C' || cfg->sig[2]!='M'
+   || cfg->sig[3]!='P' || mp->config+cfg->length>physTop
+   || !checksum((byte*)cfg, cfg->length)) {
+    return;
+  }
+  unsigned ioapicPhys = readMPConfig(cfg);
+  struct Reservation r;
+  if (!ioapicPhys || !reservePages(&r, 1)) {
+    return;
+  }
+
+  // Map the local APIC and IOAPIC registers into the kernel:
+  Pte* ptab = (Pte*)allocPage1(&r);
+  releasePages(&r);
+  ptab[0] = align((unsigned)apicBase, PAGESIZE) | PERMS_KERNEL_IO;
+  ptab[1] = align(ioapicPhys,         PAGESIZE) | PERMS_KERNEL_IO;
+  initPdir[IOSPACE>>SUPERSIZE] = toPhys(ptab) | PERMS_KERNEL_RW;
+  ioapic = (volatile unsigned*)(IOSPACE + (1<<PAGESIZE)
+                                + mask(ioapicPhys, PAGESIZE));
+
+  // Mask every input on the IOAPIC, directing them all to this CPU:
+  unsigned pins = ((ioapicRead(IOAPIC_VER)>>16) & 0xff) + 1;
+  unsigned dest = (*(volatile unsigned*)(IOSPACE + 4*LAPIC_ID)) & 0xff000000;
+  for (unsigned pin=0; pin<pins; pin++) {
+    ioapicWrite(IOAPIC_REDIR + 2*pin,     IOAPIC_MASKED);
+    ioapicWrite(IOAPIC_REDIR + 2*pin + 1, dest);
+  }
+  for (unsigned i=0; i<NUMIRQs; i++) {
+    if (irqPin[i]>=pins) {
+      irqPin[i] = NOPIN;
+    }
+  }
+
+  // Mask the PICs, and route interrupts to the APIC via the IMCR if the
+  // system starts up in PIC mode:
+  outb(0x21, 0xff);
+  outb(0xa1, 0xff);
+  if (mp->features[1] & 0x80) {
+    outb(0x22, 0x70);
+    outb(0x23, 0x01);
+  }
+
+  // Enable the local APIC, accepting interrupts at every priority:
+  lapic            = (volatile unsigned*)IOSPACE;
+  lapic[LAPIC_TPR] = 0;
+  lapic[LAPIC_SVR] = 0x100 | INT_SPURIOUS;
+  irqMasks         = 0xffff;
+DEBUG(printf("Using IOAPIC at %x for interrupts\n", ioapicPhys);)
+}
+
+/*-----------------------------------------------------------------------*/
@@ -28,6 +28,7 @@
 #include "hardware.h"
 
 #define DEBUG(cmd)   /* cmd */
+#define TRACE(cmd)   /* cmd */    // Trace page faults
 
 /*-------------------------------------------------------------------------
  * Halt a thread, removing it from the runqueue if necessary.  If the
@@ -100,21 +101,21 @@ DEBUG(printf("recvError, type=%d\n", recvtype);)
  *-----------------------------------------------------------------------*/
 
 /*-------------------------------------------------------------------------
- * Transfer a typed item from one thread to another.
+ * Transfer a typed item from one thread to another.  The caller must
+ * have reserved three pages for each item in r before the transfer began
+ * (a page table, and pages of Mappings for the sender and the receiver),
+ * so that we never run out of memory part way through a message.
  */
-static IPCErr transferTyped(
+static IPCErr transferTyped(struct Reservation* r,
  struct TCB* send, struct TCB* recv, Fpage acc, unsigned t0, unsigned t1) {
 DEBUG(printf("TRANSFER Typed Item [%x->%x] with t0=%x, t1=%x\n", send->tid, recv->tid, t0, t1);)
   if ((t0&0x3fe)==0x8) {        // MapItem?
-    if (availPages(2)) {
 DEBUG(extern void showSpace(struct Space* space);)
-      map2(send->space, (Fpage)t1, align(t0,10), recv->space, acc);
+    map2(r, send->space, (Fpage)t1, align(t0,10), recv->space, acc);
 DEBUG(printf("Completed transfer of MapItem from %x to %x:\n", send->tid, recv->tid);)
 DEBUG(showSpace(recv->space);)
 DEBUG(printf("----------------------------\n");)
-      return NoError;
-    }
-    return MessageOverflow;
+    return NoError;
   } else if ((t0&0x3fe)==0xa) { // GrantItem?
     // TODO: fill this in
   }
@@ -123,14 +124,50 @@ DEBUG(printf("IGNORING Typed Item with t0=%x, t1=%x\n", t0, t1);)
 }
 
 /*-------------------------------------------------------------------------
- * Transfer a message between two threads.
+ * Transfer the t typed words of a pager's reply to a page fault.  The
+ * first MapItem is the pager's response to the fault itself.  Any others
+ * (up to FAULTITEMS in all) are fault-around hints that allow the pager
+ * to prefetch neighbouring pages; each of these is only installed if the
+ * faulting space has nothing mapped in the corresponding range, so that
+ * a hint never disturbs an existing mapping (or its descendants).  If
+ * there is not enough memory for the hints, we just install the first.
+ */
+#define FAULTITEMS 8    // Maximum number of map items in a fault reply
+
+static IPCErr transferFault(struct TCB* send, struct TCB* recv, unsigned t) {
+  struct UTCB*       sutcb = send->utcb;
+  struct Reservation r;
+  if (!reserveSpace(&r, recv->space, t+t/2)) {
+    t = 2;
+    if (!reserveSpace(&r, recv->space, 3)) {
+      return MessageOverflow;
+    }
+  }
+  IPCErr err = transferTyped(&r, send, recv,
+                             completeFpage(), sutcb->mr[1], sutcb->mr[2]);
+  for (unsigned i=3; err==NoError && i<t; i+=2) {
+    unsigned addr = align(sutcb->mr[i], 10);
+    unsigned m    = fpageMask((Fpage)sutcb->mr[i+1]);
+    if (!mappedRange(recv->space, addr & ~m, addr | m)) {
+      err = transferTyped(&r, send, recv,
+                          completeFpage(), sutcb->mr[i], sutcb->mr[i+1]);
+    }
+  }
+  releasePages(&r);
+  return err;
+}
+
+/*-------------------------------------------------------------------------
+ * Transfer a message between two threads.  The caller records the sender
+ * as the "from" thread id of a user receiver once the transfer succeeds,
+ * so that, if the receiver is the current thread and the transfer is
+ * preempted, its registers are unchanged when the system call restarts.
  */
 static IPCErr transferMessage(
  IPCType sendtype, struct TCB* send, IPCType recvtype, struct TCB* recv) {
 DEBUG(printf("transferMessage: sendtype=%d, recvtype=%d\n", sendtype, recvtype);)
   if (recvtype==MRs) {             // Send to MRs (Destination is user ipc)
     struct UTCB* rutcb = recv->utcb;
-    IPC_SetFrom(recv)  = send->tid;            // save "from" thread id
     switch (sendtype) {
       case MRs : {                // Send between sets of message registers
           struct UTCB* sutcb = send->utcb;
@@ -146,17 +183,21 @@ DEBUG(printf("transferMessage: sendtype=%d, recvtype=%d\n", sendtype, recvtype);
               rutcb->mr[i] = sutcb->mr[i];
             }
             if (t>0) {
-              Fpage acc = rutcb->acceptor;
+              struct Reservation r;      // three pages for each typed item
+              if (!reserveSpace(&r, recv->space, t+t/2)) {
+                return MessageOverflow;
+              }
+              Fpage  acc = rutcb->acceptor;
+              IPCErr err = NoError;
               do {
-                IPCErr err = transferTyped(send, recv, acc,
-                               rutcb->mr[i]   = sutcb->mr[i],
-                               rutcb->mr[i+1] = sutcb->mr[i+1]);
-                if (err!=NoError) {
-                  // TODO: rewrite MR0 to reflect actual u, t value?
-                  return err;
-                }
+                err = transferTyped(&r, send, recv, acc,
+                                    rutcb->mr[i]   = sutcb->mr[i],
+                                    rutcb->mr[i+1] = sutcb->mr[i+1]);
+                // TODO: rewrite MR0 to reflect actual u, t value on error?
                 i += 2;
-              } while ((t-=2)>0);
+              } while (err==NoError && (t-=2)>0);
+              releasePages(&r);
+              return err;
             }
             return NoError;
           }
@@ -201,10 +242,12 @@ DEBUG(printf("transferMessage: sendtype=%d, recvtype=%d\n", sendtype, recvtype);
   } else if (sendtype==MRs) {   // Receive from MRs (Source is user ipc)
     struct UTCB* sutcb = send->utcb;
     switch (recvtype) {
-      case PageFault :  // Receive a response from a pager
-        if (mask(sutcb->mr[0],12)==MsgTag(0, 0, 2, 0)) {
-          return transferTyped(send, recv,
-                       completeFpage(), sutcb->mr[1], sutcb->mr[2]);
+      case PageFault : { // Receive a response from a pager
+          unsigned t = mask(sutcb->mr[0]>>6, 6);   // typed items
+          if (mask(sutcb->mr[0],6)==0
+              && t>0 && (t&1)==0 && t<=2*FAULTITEMS) {
+            return transferFault(send, recv, t);
+          }
         }
         break;
 
@@ -311,6 +354,9 @@ DEBUG(printf("Send %x: Transferring message ... \n", send->tid);)
       IPCErr err = transferMessage(sendtype, send, recvtype, recv);
       if (err==NoError) {
 DEBUG(printf("Send %x: Successful, resuming thread\n", send->tid);)
+        if (recvtype==MRs) {
+          IPC_SetFrom(recv) = send->tid;   // save "from" thread id
+        }
         resumeThread(recv);
         return 1;
       } else {
@@ -387,7 +433,9 @@ DEBUG(printf("Recv %x: Blocking not allowed, declaring NoPartner\n", recv->tid);
 rendezvous:;
 DEBUG(printf("Recv %x: Transferring message ...\n", recv->tid);)
     IPCType sendtype = ipctype(send);
+    allowRestart(recv==current);     // Only for the first transfer
     IPCErr  err      = transferMessage(sendtype, send, recvtype, recv);
+    allowRestart(0);
     recv->sendqueue  = removeTCB(recv->sendqueue, send);
     if (err!=NoError) {      // Error during message transfer?
 DEBUG(printf("Recv %x: Transfer fails, ending IPC ...\n", recv->tid);)
@@ -395,6 +443,9 @@ DEBUG(printf("Recv %x: Transfer fails, ending IPC ...\n", recv->tid);)
       recvError(recvtype, recv, err);
       return;
     }
+    if (recvtype==MRs) {
+      IPC_SetFrom(recv) = send->tid;       // save "from" thread id
+    }
     resumeThread(recv);
 
     // Finished with receiver, but maybe the sender we've just paired
@@ -413,15 +464,49 @@ DEBUG(printf("Recv %x: sender has no receive phase so we're done ...\n", recv->t
 /*-------------------------------------------------------------------------
  * The "IPC" System Call:
  *-----------------------------------------------------------------------*/
+
+/*-------------------------------------------------------------------------
+ * Fast path for the IPC that a user level interrupt handler makes to
+ * acknowledge an interrupt and then wait for the next one: an empty
+ * message to the interrupt thread with a blocking receive from the same
+ * thread.  There is no message to transfer in either direction, so we
+ * just reenable the interrupt, halt the interrupt thread, and block the
+ * handler.  Returns only if the IPC does not fit this pattern.
+ */
+static void ackAndWait(ThreadId irqId) {
+  unsigned n = threadNo(irqId);
+  if (n<NUMIRQs && mask(irqId, VERSIONBITS)==1
+      && mask(current->utcb->mr[0], 12)==0
+      && (current->context.regs.esi & IPCRecvBlock)) {
+    struct TCB* irqTCB = existsTCB(n);
+    if (irqTCB->status==(Receiving(Interrupt) | Halted)
+        && irqTCB->vutcb==current->tid) {
+      enableIRQ(n);                  // Reenable interrupt
+      irqTCB->status       = Halted;
+      current->utcb->mr[0] = 0;
+      removeRunnable(current);
+      current->status      = Receiving(MRs);
+      reschedule();
+    }
+  }
+}
+
 ENTRY ipc() {
 DEBUG(printf("kernel: ipc(%x) to: %x from: %x - %x [%x, %x, ...]\n", current->tid, IPC_GetTo, IPC_GetFromSpec(current), current->utcb->mr[0], current->utcb->mr[1], current->utcb->mr[2]);)
   ThreadId to = IPC_GetTo;                       // Send Phase
+  if (to==IPC_GetFromSpec(current)) {
+    ackAndWait(to);
+  }
 DEBUG(printf("ipc system call, sendphase to=%x\n", to);)
   if (to!=nilthread) {
 DEBUG(printf("non-null sendphase\n");)
-    if (!sendPhase(MRs, current, to)) {
+    allowRestart(1);                 // Transfer can be repeated
+    bool sent = sendPhase(MRs, current, to);
+    allowRestart(0);
+    if (!sent) {
       reschedule();
     }
+    IPC_GetTo = nilthread;           // Don't send again on a restart
   }
   ThreadId fromSpec = IPC_GetFromSpec(current);  // Receive Phase
 DEBUG(printf("ipc system call, recvphase  from=%x\n", fromSpec);)
@@ -457,34 +542,89 @@ DEBUG(printf("EXCEPTION: %d\n", exn);)
   reschedule();
 }
 
+/*-------------------------------------------------------------------------
+ * A general protection or stack fault in a small address space is usually
+ * the result of an access beyond the limits of its segments, in which case
+ * we convert it to a large space and retry the faulting instruction.
+ */
+static void segmentFault(int exn) {
+  if (growSpace(current->space)) {
+    reschedule();
+  }
+  handleException(exn);
+}
+
 ENTRY divideError()                { handleException(0);  }
 ENTRY debug()                      { handleException(1);  }
 ENTRY nmiInterrupt()               { handleException(2);  }
-ENTRY breakpoint()                 { handleException(3);  }
 ENTRY overflow()                   { handleException(4);  }
 ENTRY boundRangeExceeded()         { handleException(5);  }
-ENTRY deviceNotAvailable()         { handleException(7);  }
 ENTRY doubleFault()                { handleException(8);  }
 ENTRY coprocessorSegmentOverrun()  { handleException(9);  }
 ENTRY invalidTSS()                 { handleException(10); }
 ENTRY segmentNotPresent()          { handleException(11); }
-ENTRY stackSegmentFault()          { handleException(12); }
-ENTRY generalProtection()          { handleException(13); }
+ENTRY stackSegmentFault()          { segmentFault(12);    }
+ENTRY generalProtection()          { segmentFault(13);    }
 ENTRY floatingPointError()         { handleException(16); }
 ENTRY alignmentCheck()             { handleException(17); }
 ENTRY machineCheck()               { handleException(18); }
 ENTRY simdFloatingPointException() { handleException(19); }
 
+#ifdef KDB
+/*-------------------------------------------------------------------------
+ * A breakpoint in a privileged thread that is followed by the instruction
+ * "cmpb $KDB_CHECKSPACE, %al" (the encoding that the L4Ka kernel debugger
+ * uses for its commands) asks the kernel to check the memory map of the
+ * space containing the thread whose id is in eax, returning the number of
+ * mappings in that space in eax (or zero if there is no such thread).
+ * The check runs without preemption points, so this hook is only included
+ * in kernels that are built with KDB, for use in tests.  Any other
+ * breakpoint is reported as an exception.
+ */
+#define KDB_CHECKSPACE 0x20
+
+ENTRY breakpoint() {
+  unsigned eip = current->context.iret.eip
+               + spaceBase(current->space);     // linear address
+  if (privileged(current->space) && eip<KERNEL_SPACE-1
+      && userMapped(eip) && userMapped(eip+1)
+      && ((byte*)eip)[0]==0x3c && ((byte*)eip)[1]==KDB_CHECKSPACE) {
+    extern unsigned checkSpace(struct Space* space);
+    struct TCB* tcb = findTCB(current->context.regs.eax);
+    current->context.iret.eip += 2;
+    current->context.regs.eax  = tcb ? checkSpace(tcb->space) : 0;
+    resume();
+  }
+  handleException(3);
+}
+#else
+ENTRY breakpoint()                 { handleException(3);  }
+#endif
+
+/*-------------------------------------------------------------------------
+ * A device not available exception is usually the first use of the FPU
+ * since the current thread was switched in (see "Lazy FPU switching").
+ */
+ENTRY deviceNotAvailable() {
+  if (claimFPU()) {
+    resume();
+  }
+  handleException(7);
+}
+
 /*-------------------------------------------------------------------------
  * Generate an IPC in response to a page fault in the current thread.
  */
 ENTRY pageFault() {
   asm("  movl %%cr2, %0\n" : "=r"(current->faultCode));
+  current->faultCode -= spaceBase(current->space); // linear -> virtual
 // abortIf(((current->faultCode)&4)==0, "page fault in kernel mode");
-   printf("page fault handler: eip=%x, error=%x, fault addr=%x\n",
-    current->context.iret.eip, current->context.iret.error, current->faultCode);
+TRACE(printf("page fault handler: eip=%x, error=%x, fault addr=%x\n",
+  current->context.iret.eip, current->context.iret.error, current->faultCode);)
   if (current->space==sigma0Space && sigma0map(current->faultCode)) {
-    printf("sigma0 case succeeded!\n");
+TRACE(printf("sigma0 case succeeded!\n");)
+  } else if (refillSpace(current->space, current->faultCode)) {
+DEBUG(printf("refilled page table for shared slot\n");)
   } else {
     ThreadId  pagerId = current->utcb->pager;
 DEBUG(printf("pagerId=%x\n", pagerId);)
@@ -509,7 +649,8 @@ DEBUG(else { printf("SendPhase to %x did not succeed\n", pagerId); })
  * over to a generic exception handler.
  */
 ENTRY invalidOpcode() {
-  byte* eip = (byte*)current->context.iret.eip;
+  byte* eip = (byte*)(current->context.iret.eip
+                      + spaceBase(current->space)); // linear address
   // TODO: Confirm that (1) this works; and (2) it can't page fault!
   if (eip[0]==0xf0 && eip[1]==0x90) { // Check for LOCK NOP instruction
     current->context.iret.eip += 2;   // found => KernelInterface syscall
@@ -528,7 +669,7 @@ ENTRY invalidOpcode() {
 ENTRY hardwareIRQ() {
   unsigned n = current->context.iret.error;
 DEBUG(printf("Hardware IRQ %d\n", n);)
-  maskAckIRQ(n); // Mask and acknowledge the interrupt with the PIC
+  maskAckIRQ(n); // Mask and acknowledge the interrupt
   struct TCB* irqTCB = existsTCB(n);
   // An irq thread may be Halted, Sending (i.e., waiting for the user level
   // handler to receive notice of the interrupt), or Receiving (i.e., waiting
@@ -543,11 +684,20 @@ DEBUG(printf("Hardware IRQ %d\n", n);)
   if (irqTCB->status==Halted && irqTCB->vutcb!=nilthread) {
     if (sendPhase(Interrupt, irqTCB, irqTCB->vutcb)) {
       irqTCB->status = Receiving(Interrupt) | Halted;
+      switchIfHigher(findTCB(irqTCB->vutcb)); // Run handler immediately?
     }
   }
   reschedule(); // allow the user level handler to begin ...
 }
 
+/*-------------------------------------------------------------------------
+ * Ignore a spurious interrupt from the local APIC (these are not
+ * acknowledged).
+ */
+ENTRY spuriousInterrupt() {
+  resume();
+}
+
 /*-------------------------------------------------------------------------
  * The "ExchangeRegisters" System Call:
  *-----------------------------------------------------------------------*/
@@ -27,11 +27,45 @@
 
 #define DEBUG(cmd)   /*cmd*/
 
-unsigned     numFreePages = 0;
-static void* freePageList = 0;
+unsigned     numFreePages = 0;  // Number of pages on the free list
+unsigned     numReserved  = 0;  // Number of free pages that are reserved
 
 /*-------------------------------------------------------------------------
- * Determine how many pages (out of a given maximum available) we should
+ * The free list is doubly linked, using the first two words of each free
+ * page, so that reclaimPages() can remove a page from the middle of the
+ * list without searching for its predecessor.
+ */
+struct FreePage {
+  struct FreePage* next;
+  struct FreePage* prev;
+};
+
+static struct FreePage* freePageList = 0;
+
+/*-------------------------------------------------------------------------
+ * Kernel memory is taken from conventional memory at boot, but pages can
+ * also be donated to the kernel, or returned to sigma0, while the system
+ * is running (see MemoryControl).  We use a bitmap, with one bit for each
+ * page frame in the kernel window, to record which pages are currently
+ * owned by the kernel.  (The Reserved memory descriptors in the KIP only
+ * describe the pages that were taken at boot.)  A second bitmap records
+ * which of those pages are on the free list, so that the free pages in a
+ * given range can be found without walking the whole list.
+ */
+static unsigned kernelFrames[REALPHYSMAP>>(PAGESIZE+5)];
+static unsigned freeFrames[REALPHYSMAP>>(PAGESIZE+5)];
+
+static inline void setFrame(unsigned* map, unsigned phys, bool set) {
+  unsigned frame = phys>>PAGESIZE;
+  if (set) {
+    map[frame>>5] |= (1<<mask(frame, 5));
+  } else {
+    map[frame>>5] &= ~(1<<mask(frame, 5));
+  }
+}
+
+/*-------------------------------------------------------------------------
+ * Determine how many pages (out of a given total available) we should
  * take for kernel memory.
  */
 static unsigned kernelPages(unsigned upper) {
@@ -77,16 +111,79 @@ static void initPages(unsigned lo, unsigned pages) {
   DEBUG(printf("initPages(%x,%x)\n", lo, hi);)
   for (lo=align(lo+pg-1, PAGESIZE); (lo+pg-1)<=hi; lo+=pg) {
     DEBUG(printf("lo = %x, pg=%x\n", lo, pg);)
+    setFrame(kernelFrames, lo, 1);
     freePage(fromPhys(void*, lo));
   }
 }
 
 /*-------------------------------------------------------------------------
- * Use boot data to initialize memory descriptors and memory allocator.
+ * Extend the kernel's window on physical memory, which initially covers
+ * just the first PHYSMAP bytes that were mapped by boot.S, so that it
+ * includes every physical address up to and including hi (but no more
+ * than REALPHYSMAP bytes in total).  The window is described by superpage
+ * entries in the initial page directory, which are copied in to (or, with
+ * PAE, shared by) every new page directory built by allocPdir5().
+ */
+unsigned physTop = PHYSMAP;   // First physical address beyond kernel window
+
+static void initKernelWindow(unsigned hi) {
+  while (physTop<REALPHYSMAP && physTop<=hi) {
+    initPdir[(KERNEL_SPACE+physTop)>>SUPERSIZE] = physTop | PERMS_KERNELSPACE;
+    physTop += (1<<SUPERSIZE);
+  }
+  asm volatile("  movl  %%cr3, %%eax\n  movl  %%eax, %%cr3\n" : : : "eax");
+  DEBUG(printf("Kernel window covers physical [0-%x]\n", physTop-1);)
+}
+
+/*-------------------------------------------------------------------------
+ * Scan the portion of a conventional memory range that falls within the
+ * kernel window, skipping any pages that are used by boot modules, and
+ * return the number of free pages that we find.  The first take of those
+ * pages are also added to the kernel's free list.
  */
 struct MemRange { unsigned lo; unsigned hi; };
 struct Header   { unsigned lo; unsigned hi; unsigned entry; };
 
+static unsigned scanRange(struct MemRange* rng,
+                          struct Header* hdrs, unsigned numhdrs,
+                          unsigned take) {
+  unsigned found = 0;
+  unsigned lo    = rng->lo;
+  unsigned hi    = min(rng->hi, physTop-1);
+  while (lo<hi) {
+    lo = align(lo + (1<<PAGESIZE) - 1, PAGESIZE);
+    unsigned earidx = numhdrs;          // Find earliest allocated region
+    unsigned earlo  = hi+1;
+    unsigned earhi  = 0;
+    for (unsigned j=0; j<numhdrs; j++) {
+      unsigned hlo = max(lo, hdrs[j].lo);
+      unsigned hhi = min(hi, hdrs[j].hi);
+      if (hlo<=hhi && hlo<earlo) {
+        earidx = j;
+        earlo  = hlo;
+        earhi  = hhi;
+      }
+    }
+    unsigned end = align(earlo, PAGESIZE);  // Free pages are in [lo,end)
+    if (lo<end) {
+      unsigned n = (end-lo) >> PAGESIZE;
+      if (found<take) {
+        initPages(lo, min(n, take-found));
+      }
+      found += n;
+    }
+    if (earidx==numhdrs) {              // No intersecting region found.
+      break;
+    }
+    lo = earhi+1;
+  }
+  DEBUG(printf("  scanRange [%x-%x]: %x pages\n", rng->lo, rng->hi, found);)
+  return found;
+}
+
+/*-------------------------------------------------------------------------
+ * Use boot data to initialize memory descriptors and memory allocator.
+ */
 void initMemory() {
   struct BootData* bd   = (struct BootData*)KERNEL_SPACE;
   unsigned numrngs      = *(bd->mmap);
@@ -111,11 +208,13 @@ void initMemory() {
   }
 
   // Add Memory Descriptors to KIP: ---------------------------------------
-  addMemDesc(0, KERNEL_SPACE-1, Virtual); // Virtual address space
+  unsigned top = 0;
+  addMemDesc(0, SMALLSPACES-1, Virtual);  // Virtual address space
   addMemDesc(0, 0xffffffff, Shared);      // Full 32 bit address space
   addMemDesc(0xa0000, 0xfffff, Shared);   // Video RAM, BIOS ROMs, etc...
   for (i=0; i<numrngs; i++) {             // Conventional memory regions
     addMemDesc(rngs[i].lo, rngs[i].hi, Conventional);
+    top = max(top, rngs[i].hi);
     DEBUG(printf(" rngs[%d]: [%x-%x]\n", i, rngs[i].lo, rngs[i].hi);)
   }
   for (j=0; j<numhdrs; j++) {             // Reserved boot modules
@@ -125,88 +224,202 @@ void initMemory() {
   }
 
   // ----------------------------------------------------------------------
-  // Find out which region in the memory map has most free space, taking
-  // account of memory areas listed in headers and limited to the portion
-  // of physical memory that is accessible within the PHYSMAP.
-  unsigned maxsize = 0;        // size of biggest range
-  unsigned maxidx  = numrngs;  // index of biggest range
+  // Size the kernel window to fit the installed memory, then count the
+  // free pages in every conventional region within that window, and take
+  // our share of them for kernel memory.  Everything else, including any
+  // memory beyond the kernel window, is left for sigma0.
+  initKernelWindow(top);
+  unsigned avail = 0;
   for (i=0; i<numrngs; i++) {
-    // Find lo and hi addresses in this range, truncated to PHYSMAP
-    unsigned lo = rngs[i].lo;
-    unsigned hi = min(rngs[i].hi, PHYSMAP-1);
-    if (lo < hi && ((1<<PAGESIZE)-1 < hi)) {
-      // Round lo and hi to page start and end addresses
-      lo = (((lo - 1) >> PAGESIZE) + 1) << PAGESIZE;
-      hi = align(hi + 1, PAGESIZE) - 1;
-      unsigned size = 1 + hi - lo;
-      DEBUG(printf("  Page boundaries: [%x-%x] (size %x)\n", lo, hi, size);)
-      // Scan headers to look for overlapping regions
-      for (j=0; j<numhdrs; j++) {
-        unsigned hlo = align(max(lo, hdrs[j].lo), PAGESIZE);
-        unsigned hhi = ~align(~min(hi, hdrs[j].hi), PAGESIZE);
-        if (hlo < hhi) {
-          // It's possible to overestimate the amount of used space in
-          // this region if two header ranges intersect the same physical
-          // page.  However, this (1) isn't likely to happen very often;
-          // and (2) isn't a serious problem.
-          DEBUG(printf("  Size = %x\n", 1 + hhi - hlo);)
-          size -= 1 + hhi -hlo;
-        }
-      }
-      if (maxsize < size) {
-        maxsize = size;
-        maxidx  = i;
-      }
+    avail += scanRange(rngs+i, hdrs, numhdrs, 0);
+  }
+  unsigned pages = kernelPages(avail);
+  for (i=0; i<numrngs && pages>0; i++) {
+    pages -= min(pages, scanRange(rngs+i, hdrs, numhdrs, pages));
+  }
+  ASSERT(freePageList!=0, "Unable to allocate kernel memory");
+  DEBUG(printf("numFreePages = %d\n", numFreePages);)
+}
+
+/*-------------------------------------------------------------------------
+ * Determine whether a given physical address is currently in use as
+ * kernel memory, and hence must never be mapped in to user space.
+ */
+bool kernelMemory(unsigned phys) {
+  unsigned frame = phys>>PAGESIZE;
+  return phys<physTop && (kernelFrames[frame>>5] & (1<<mask(frame, 5)));
+}
+
+/*-------------------------------------------------------------------------
+ * Determine whether any page in the physical address range [lo,hi] is
+ * currently in use as kernel memory.
+ */
+bool kernelMemoryIn(unsigned lo, unsigned hi) {
+  unsigned last = min(hi, physTop-1)>>PAGESIZE;
+  for (unsigned frame=lo>>PAGESIZE; frame<=last; frame++) {
+    if (kernelFrames[frame>>5] & (1<<mask(frame, 5))) {
+      return 1;
     }
   }
+  return 0;
+}
 
-  // ----------------------------------------------------------------------
-  // Allocate kernel memory pages from the region with most free space
-  if (maxidx < numrngs) {               // (assuming there is one ...)
-    unsigned lo    = rngs[maxidx].lo;
-    unsigned hi    = min(rngs[maxidx].hi, PHYSMAP-1);
-    unsigned pages = kernelPages((1 + hi - lo) >> PAGESIZE);
-    for (;;) {
-      unsigned earidx = numhdrs;        // Find earliest allocated region
-      unsigned earlo  = ~0;
-      unsigned earhi  = 0;
-      for (j=0; j<numhdrs; j++) {
-        unsigned hlo = align(max(lo, hdrs[j].lo), PAGESIZE);
-        unsigned hhi = ~align(~min(hi, hdrs[j].hi), PAGESIZE);
-        if (hlo<hhi && hlo<earlo) {
-          earidx = j;
-          earlo  = hlo;
-          earhi  = hhi;
-        }
-      }
-      if (earidx==numhdrs) {            // No intersecting region found.
-        initPages(lo, min((1 + hi - lo) >> PAGESIZE, pages));
-        break;
-      }
-      if (earlo>lo) {
-        unsigned maxp = min((earlo-lo) >> PAGESIZE, pages);
-        initPages(lo, maxp);
-        if ((pages -= maxp) == 0) {     // Are we done?
-          break;
-        }
+/*-------------------------------------------------------------------------
+ * Determine whether a given physical address is in a memory descriptor of
+ * the specified type.
+ */
+static bool memDescType(unsigned phys, enum MemType type) {
+  unsigned n = mask(MemoryInfo, 16);
+  for (unsigned i=0; i<n; i++) {
+    if (mask(MemDesc[i].lo, 10)==type
+        && align(MemDesc[i].lo, 10)<=phys
+        && phys<=(MemDesc[i].hi|0x3ff)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*-------------------------------------------------------------------------
+ * Determine whether the physical address range [lo,hi] is all available
+ * conventional memory: it must lie within a single conventional memory
+ * descriptor, and must not overlap any reserved region or kernel memory.
+ */
+bool conventionalRange(unsigned lo, unsigned hi) {
+  unsigned n    = mask(MemoryInfo, 16);
+  bool     conv = 0;
+  for (unsigned i=0; i<n; i++) {
+    unsigned dlo = align(MemDesc[i].lo, 10);
+    unsigned dhi = MemDesc[i].hi|0x3ff;
+    if (mask(MemDesc[i].lo, 10)==Conventional && dlo<=lo && hi<=dhi) {
+      conv = 1;
+    } else if (mask(MemDesc[i].lo, 10)==Reserved && dlo<=hi && lo<=dhi) {
+      return 0;
+    }
+  }
+  return conv && !kernelMemoryIn(lo, hi);
+}
+
+/*-------------------------------------------------------------------------
+ * Determine whether the page at a given physical address could be donated
+ * to the kernel: it must be a page of conventional memory, within the
+ * kernel window, that is not part of a boot module, and that is not
+ * already in use as kernel memory.
+ */
+bool donatable(unsigned phys) {
+  return phys<physTop
+      && !kernelMemory(phys)
+      && memDescType(phys, Conventional)
+      && !memDescType(phys, BootModules);
+}
+
+/*-------------------------------------------------------------------------
+ * Add a page to the kernel's free list.  The caller must already have
+ * checked that the page is donatable(), and have removed any user space
+ * mappings for it.
+ */
+void donatePage(unsigned phys) {
+  ASSERT(donatable(phys), "donating page that is not available");
+  setFrame(kernelFrames, phys, 1);
+  freePage(fromPhys(void*, align(phys, PAGESIZE)));
+}
+
+/*-------------------------------------------------------------------------
+ * Remove a page from the free list.
+ */
+static void unlinkPage(struct FreePage* page) {
+  if (page->next) {
+    page->next->prev = page->prev;
+  }
+  if (page->prev) {
+    page->prev->next = page->next;
+  } else {
+    freePageList     = page->next;
+  }
+  setFrame(freeFrames, toPhys(page), 0);
+  numFreePages--;
+}
+
+/*-------------------------------------------------------------------------
+ * Remove free, unreserved pages with physical addresses in the range
+ * [lo, hi] from the free list so that they can be returned to sigma0,
+ * returning the number of pages that were found.  The search is over the
+ * freeFrames bitmap, a word at a time, so the cost is bounded by the size
+ * of the kernel window rather than the length of the free list.
+ */
+unsigned reclaimPages(unsigned lo, unsigned hi) {
+  unsigned count = 0;
+  unsigned frame = lo>>PAGESIZE;
+  unsigned last  = min(hi, physTop-1)>>PAGESIZE;
+  while (frame<=last && numFreePages>numReserved) {
+    unsigned bits = freeFrames[frame>>5] >> mask(frame, 5);
+    if (bits==0) {                      // Skip to the next bitmap word
+      frame = align(frame, 5) + 32;
+    } else {
+      if (bits&1) {
+        unsigned phys = frame<<PAGESIZE;
+        unlinkPage(fromPhys(struct FreePage*, phys));
+        setFrame(kernelFrames, phys, 0);
+        count++;
       }
-      lo = earhi+1;
+      frame++;
     }
   }
-  ASSERT(freePageList!=0, "Unable to allocate kernel memory");
-  DEBUG(printf("numFreePages = %d\n", numFreePages);)
+  DEBUG(printf("reclaimPages(%x,%x) = %d\n", lo, hi, count);)
+  return count;
 }
 
 /*-------------------------------------------------------------------------
- * Allocate a single zeroed page of kernel memory from the free list.
+ * Reserve n pages of kernel memory for an operation that is about to
+ * begin, returning true if the reservation succeeds.  If there are not
+ * enough unreserved pages, then the reservation is left empty, and the
+ * caller should abandon the operation before making any changes.  (If we
+ * ever have genuinely concurrent accesses to the free list (e.g., SMP),
+ * then this will be the only place where we need to synchronize.)
  */
-void* allocPage1() {
+bool reservePages(struct Reservation* r, unsigned n) {
+  if (numFreePages-numReserved >= n) {
+    numReserved += n;
+    r->pages     = n;
+    return 1;
+  }
+  r->pages = 0;
+  return 0;
+}
+
+/*-------------------------------------------------------------------------
+ * Release any pages that are left in a reservation once the operation
+ * that requested it is complete.
+ */
+void releasePages(struct Reservation* r) {
+  numReserved -= r->pages;
+  r->pages     = 0;
+}
+
+/*-------------------------------------------------------------------------
+ * Cancel every outstanding reservation when the kernel operation that
+ * holds them is abandoned at a preemption point.  Reservations never
+ * outlive a single entry to the kernel, so any that are still held at
+ * that point belong to the operation that is being abandoned.
+ */
+void cancelReservations() {
+  numReserved = 0;
+}
+
+/*-------------------------------------------------------------------------
+ * Allocate a single zeroed page of kernel memory from the free list,
+ * using one of the pages in the given reservation.
+ */
+void* allocPage1(struct Reservation* r) {
+  ASSERT(r->pages>0, "allocation exceeds reservation");
   ASSERT(freePageList!=0, "page allocate fails");
   void* result = freePageList;
   unsigned  i  = (1<<10);
   unsigned* p  = (unsigned*)result;
-  numFreePages--;
-  for (freePageList = *((void**)result); i>0; i--) {
+  r->pages--;
+  numReserved--;
+  unlinkPage(freePageList);
+  for (; i>0; i--) {
     *p++ = 0;  // zero all elements; 
   }
   ASSERT(mask((unsigned)result, PAGESIZE)==0, "allocating misaligned page");
@@ -221,32 +434,30 @@ void* allocPage1() {
 void freePage(void* page) {
   ASSERT(mask((unsigned)page, PAGESIZE)==0, "free on misaligned page");
   DEBUG(printf("freePage(%x)\n", page);)
-  *((void**)page) = freePageList;
-  freePageList    = page;
+  struct FreePage* fp = (struct FreePage*)page;
+  fp->next = freePageList;
+  fp->prev = 0;
+  if (freePageList) {
+    freePageList->prev = fp;
+  }
+  freePageList = fp;
+  setFrame(freeFrames, toPhys(page), 1);
   numFreePages++;
 }
 
-/*-------------------------------------------------------------------------
- * Test for available pages.  This whole approach will need a rethink if
- * we have genuinely concurrent accesses (e.g., SMP) that make demands on
- * the same free list ... a reservation system instead perhaps?
- */
-bool availPages(unsigned n) {
-  return numFreePages>=n;
-}
-
 /*-------------------------------------------------------------------------
  * Run a consistency check on the allocator's free list.
  */
 void checkMem() {
   unsigned count = 0;
-  void*    fr    = freePageList;
+  struct FreePage* fr = freePageList;
   printf("Checking free list ... ");
   while (fr) {
     count++;
-    fr = *((void**)fr); 
+    fr = fr->next;
   }
-  printf("intact with %d elements (%d expected)\n",count, numFreePages);
+  printf("intact with %d elements (%d expected, %d reserved)\n",
+         count, numFreePages, numReserved);
 }
 
 /*-----------------------------------------------------------------------*/
@@ -38,8 +38,10 @@ ENTRY init() {
   cls();
 
   initMemory();
+  initInterrupts();
   initSpaces();
   initTCBs();
+  initFPU();
   startTimer();
   reschedule();
   printf("System halting\n");  // Should be unreachable
@@ -81,11 +83,48 @@ ENTRY processorControl() { // TODO: Put this someplace else!
 /*-------------------------------------------------------------------------
  * The "MemoryControl" System Call:
  *-----------------------------------------------------------------------*/
+#define KernelMemory  0xfffffffe    // Donate pages to the kernel
+#define ReclaimMemory 0xfffffffd    // Return idle kernel pages to sigma0
+
 ENTRY memoryControl() { // TODO: Put this someplace else!
   if (!privileged(current->space)) {         // check for privileged thread
-    retError(ProcessorControl_Result, NO_PRIVILEGE);
+    retError(MemoryControl_Result, NO_PRIVILEGE);
   } else {
-    // TODO: Fill this in ...
+    // The fpages are in MR0..MRt, and the low two bits of each fpage
+    // select one of the four attribute registers.  Cache attributes are
+    // not yet supported, but sigma0, which owns all physical memory, can
+    // use the KernelMemory and ReclaimMemory attributes to move pages
+    // in to or out of the kernel's free list at runtime.  The number of
+    // pages moved is returned in MR0.
+    unsigned  t       = MemoryControl_Control;
+    unsigned  attr[4] = { MemoryControl_Attribute0, MemoryControl_Attribute1,
+                          MemoryControl_Attribute2, MemoryControl_Attribute3 };
+    unsigned* mr      = current->utcb->mr;
+    unsigned  i;
+    if (t>=NUMMRS) {
+      retError(MemoryControl_Result, INVALID_PARAMETER);
+    }
+    for (i=0; i<=t; i++) {                   // validate all attributes
+      unsigned a = attr[mask(mr[i], 2)];
+      if ((a==KernelMemory || a==ReclaimMemory)
+          && current->space!=sigma0Space) {
+        retError(MemoryControl_Result, NO_PRIVILEGE);
+      }
+    }
+    unsigned count = 0;
+    for (i=0; i<=t; i++) {
+      Fpage fp = (Fpage)mr[i];
+      switch (attr[mask(fp, 2)]) {
+        case KernelMemory  : count += donateFpage(fp);
+                             break;
+        case ReclaimMemory : count += reclaimPages(fpageStart(fp),
+                                                   fpageEnd(fp));
+                             break;
+      }
+    }
+    refreshSpace();   // donations may have changed the current space
+    mr[0]                = count;
+    MemoryControl_Result = 1;
   }
   resume();
 }
@@ -43,12 +43,13 @@ void initScheduling() {
   }
 
   // Construct idle thread: -----------------------------------------------
-  abortIf(!availPages(2), "Failed to allocate idle thread");
-  struct Space* idleSpace   = allocSpace1();
+  struct Reservation r;
+  abortIf(!reservePages(&r, 1), "Failed to allocate idle thread");
   ThreadId      idleTid     = threadId(SYSTEMBASE, 1);
-  idleTCB                   = allocTCB1(idleTid, idleSpace, idleTid);
+  idleTCB                   = allocTCB1(&r, idleTid, kernelSpace, idleTid);
   idleTCB->timeslice        = 0;
-  initIdleContext(&(idleTCB->context), (unsigned)halt);
+  initIdleContext(&(idleTCB->context), (unsigned)idle);
+  releasePages(&r);
 }
 
 /*-------------------------------------------------------------------------
@@ -177,22 +178,190 @@ void removeRunnable(struct TCB* tcb) {       // Pre: tcb is in the runqueue
 }
 
 /*-------------------------------------------------------------------------
- * Switch to a specific user thread.  In general, this will not be the same
- * as the most recently executed user thread, so we do not make any special
- * case for the possibility that tcb==current.
+ * Lazy FPU switching:
+ *
+ * Most threads never use the FPU (or MMX/SSE), so we do not save and
+ * restore its state on every context switch.  Instead, we set the task
+ * switched (TS) flag in cr0 when we switch to a thread that does not own
+ * the state in the FPU (and clear it again when we switch back to the
+ * owner), so that the first FPU instruction of any other thread triggers
+ * a device not available (#NM) exception.  At that point, we save the
+ * state of the previous owner in its FXSAVE area and load the state of
+ * the current thread, allocating an area for it if this is the first
+ * time that it has used the FPU.
+ *
+ * Each thread number has its own 512 byte area, so there is no limit on
+ * the number of threads that can use the FPU.  Areas are grouped in pages
+ * of FPUPERPAGE consecutive thread numbers, and the pages are found
+ * through a two level table: fpuTables has one entry for each block of
+ * (1<<FPUTABLE) pages, pointing to a page of pointers to those pages.
+ * Both levels are allocated on demand from a reservation for the space
+ * of the thread that needs them, and freed again when they are no longer
+ * in use; the space is charged for each area that its threads hold.  The
+ * fpu flag in the TCB records whether the thread has an area.  If no area
+ * can be allocated (or the processor does not support FXSAVE), then the
+ * #NM is passed on to the thread's exception handler instead.
+ *-----------------------------------------------------------------------*/
+#define FPUSIZE    9                            // 512 bytes per area
+#define FPUPERPAGE (1<<(PAGESIZE-FPUSIZE))      // Areas in each page
+#define FPUTABLE   (PAGESIZE-2)                 // log2(page pointers/table)
+#define FPUTABLES  (((1<<THREADBITS)/FPUPERPAGE)>>FPUTABLE)
+
+static void**      fpuTables[FPUTABLES]; // Tables of pointers to area pages
+static unsigned    fpuPages[FPUTABLES];  // Number of pages in each table
+static struct TCB* fpuOwner = 0;        // Thread whose state is in the FPU
+static bool        fpuLazy  = 0;        // 1 => lazy switching enabled
+static bool        fpuTS    = 0;        // 1 => TS flag is set in cr0
+
+/*-------------------------------------------------------------------------
+ * Return a pointer to the entry for the page that holds the area for the
+ * nth thread; the table for that entry must already exist.
+ */
+static inline void** fpuPage(unsigned n) {
+  unsigned p = n / FPUPERPAGE;
+  return fpuTables[p>>FPUTABLE] + mask(p, FPUTABLE);
+}
+
+static inline unsigned* fpuArea(struct TCB* tcb) {
+  unsigned n = threadNo(tcb->tid);
+  return (unsigned*)((byte*)*fpuPage(n) + ((n%FPUPERPAGE)<<FPUSIZE));
+}
+
+/*-------------------------------------------------------------------------
+ * Enable fxsave/fxrstor (and SSE) and native FPU exceptions, if the
+ * processor supports them.
+ */
+void initFPU() {
+  for (unsigned i=0; i<FPUTABLES; i++) {
+    fpuTables[i] = 0;
+    fpuPages[i]  = 0;
+  }
+  unsigned eax, edx;
+  cpuid(1, &eax, &edx);
+  if (edx & (1<<24)) {                          // fxsave supported?
+    setCR4(getCR4() | CR4_OSFXSR
+                    | ((edx & (1<<25)) ? CR4_OSXMMEXCPT : 0));
+    setCR0((getCR0() & ~CR0_EM) | CR0_MP | CR0_NE);
+    fpuLazy = 1;
+  }
+}
+
+/*-------------------------------------------------------------------------
+ * Set or clear the TS flag, as necessary, on a switch to the given thread.
+ */
+static inline void switchFPU(struct TCB* tcb) {
+  if (fpuLazy && (tcb!=fpuOwner)!=fpuTS) {
+    fpuTS = !fpuTS;
+    setCR0(getCR0() ^ CR0_TS);
+  }
+}
+
+/*-------------------------------------------------------------------------
+ * Allocate an FXSAVE area for the current thread, initialized with the
+ * state that the FPU has after a reset (fninit, and the default MXCSR).
+ * This runs in response to an exception, and cannot be restarted, so it
+ * fails, rather than waiting for dying spaces to be torn down, if there
+ * is not enough memory.
+ */
+static bool allocFPU() {
+  unsigned           n = threadNo(current->tid);
+  unsigned           t = (n/FPUPERPAGE)>>FPUTABLE;
+  struct Reservation r;
+  if (!reserveSpace(&r, current->space,
+                    !fpuTables[t] ? 2 : !*fpuPage(n) ? 1 : 0)
+   || !tryChargeSpace(current->space, 1<<FPUSIZE)) {
+    releasePages(&r);
+    return 0;
+  }
+  if (!fpuTables[t]) {
+    fpuTables[t] = (void**)allocPage1(&r);
+  }
+  if (!*fpuPage(n)) {
+    *fpuPage(n) = allocPage1(&r);
+    fpuPages[t]++;
+  }
+  releasePages(&r);
+  unsigned* area = fpuArea(current);
+  for (unsigned i=0; i<(1<<FPUSIZE)/sizeof(unsigned); i++) {
+    area[i] = 0;
+  }
+  area[0]      = 0x037f;    // FPU control word
+  area[6]      = 0x1f80;    // MXCSR
+  current->fpu = 1;
+  return 1;
+}
+
+/*-------------------------------------------------------------------------
+ * Give the FPU to the current thread in response to a #NM exception,
+ * returning false if that is not possible.
+ */
+bool claimFPU() {
+  if (!fpuLazy || (!current->fpu && !allocFPU())) {
+    return 0;
+  }
+  clts();
+  fpuTS = 0;
+  if (fpuOwner) {
+    fxsave(fpuArea(fpuOwner));
+  }
+  fxrstor(fpuArea(current));
+  fpuOwner = current;
+  return 1;
+}
+
+/*-------------------------------------------------------------------------
+ * Release the FXSAVE area (if any) for a thread that is being deleted,
+ * freeing the page that holds it if none of the other threads that share
+ * the page have an area, and then the table for that page if it is empty.
+ */
+void releaseFPU(struct TCB* tcb) {
+  if (tcb->fpu) {
+    unsigned n = threadNo(tcb->tid);
+    unsigned t = (n/FPUPERPAGE)>>FPUTABLE;
+    if (fpuOwner==tcb) {
+      fpuOwner = 0;         // Discard the state in the FPU
+    }
+    tcb->fpu = 0;
+    refundSpace(tcb->space, 1<<FPUSIZE);
+    for (unsigned i=n-n%FPUPERPAGE; i<n-n%FPUPERPAGE+FPUPERPAGE; i++) {
+      struct TCB* other = existsTCB(i);
+      if (other && other->fpu) {
+        return;
+      }
+    }
+    freePage(*fpuPage(n));
+    *fpuPage(n) = 0;
+    if (--fpuPages[t]==0) {
+      freePage(fpuTables[t]);
+      fpuTables[t] = 0;
+    }
+  }
+}
+
+/*-------------------------------------------------------------------------
+ * Switch to a specific thread.  In general, this will not be the same
+ * as the most recently executed thread, so we do not make any special
+ * case for the possibility that tcb==current.  Kernel threads (like the
+ * idle thread) only use kernel mappings, which are the same in every
+ * page directory, so they run on whichever space was last loaded; this
+ * avoids reloading cr3 (and flushing the TLB) on the way in to a kernel
+ * thread, and again on the way back out if we return to the same space.
  */
 static void inline switchTo(struct TCB* tcb) {
   struct Context* ctxt = &(tcb->context);
 DEBUG(printf("Switching to thread %x (tcb=%x)\n", tcb->tid, tcb);)
   current  = tcb;                  // Change current thread
-  *utcbptr = tcb->vutcb            // Change UTCB address
-             + (unsigned)&(((struct UTCB*)0)->mr[0]); // TODO: fix this
-DEBUG(printf("set utcbptr to %x\n", *utcbptr);)
   esp0     = (unsigned)(ctxt + 1); // Change esp0
+  if (tcb->space!=kernelSpace) {   // Kernel threads have no UTCB or space
+    *utcbptr = tcb->vutcb          // Change UTCB address
+               + (unsigned)&(((struct UTCB*)0)->mr[0]); // TODO: fix this
+DEBUG(printf("set utcbptr to %x\n", *utcbptr);)
 DEBUG(extern void showSpace(struct Space* space);)
 DEBUG(showSpace(tcb->space);)
-  switchSpace(tcb->space);        // Change address space
+    switchSpace(tcb->space);       // Change address space
 DEBUG(printf("switched space, context is at %x\n\n", ctxt);)
+    switchFPU(tcb);                // Trap the first use of the FPU
+  }
   returnToContext(ctxt);
 }
 
@@ -204,6 +373,76 @@ void reschedule() {
   switchTo(holder = priosetSize ? runqueue[prioset[0]] : idleTCB);
 }
 
+/*-------------------------------------------------------------------------
+ * Switch straight to a thread that has just become runnable (such as the
+ * user level handler for an interrupt) if it has a higher priority than
+ * the current timeslice holder, and hence than every other runnable
+ * thread, without looking in the runqueue.  Returns only if the thread
+ * should not preempt the holder.
+ */
+void switchIfHigher(struct TCB* tcb) {
+  if (tcb->status==Runnable && (holder==idleTCB || tcb->prio>holder->prio)) {
+    switchTo(holder = tcb);
+  }
+}
+
+/*-------------------------------------------------------------------------
+ * Idle time: the idle thread runs in kernel mode, trapping into the kernel
+ * through a vector that cannot be used from user mode each time around
+ * its loop.  The trap runs with interrupts disabled, but the idle thread
+ * can be interrupted between traps, so each one only performs a bounded
+ * slice of work.  The result in eax tells the idle thread whether it
+ * should come straight back or halt until the next interrupt.
+ */
+ENTRY idleWork() {
+  allowRestart(1);
+  current->context.regs.eax = reclaimSpaces();
+  allowRestart(0);
+  resume();
+}
+
+/*-------------------------------------------------------------------------
+ * Preemption points:
+ *
+ * The kernel runs with interrupts disabled on a single kernel stack, so
+ * an operation that might run for a long time (such as flushing a large
+ * part of the mapping database) cannot just enable interrupts part way
+ * through.  Instead, such an operation is written so that it leaves the
+ * kernel data structures in a consistent state at each preemption point,
+ * and the system call that started it can be repeated, without harm, by
+ * a thread that is wound back to its int instruction.  Each system call
+ * that can be restarted in this way brackets the restartable part of its
+ * work with calls to allowRestart(), saving any record of the progress
+ * that it has made so far in the thread's registers.  If an interrupt is
+ * pending when we reach a preemption point, then we abandon the current
+ * operation and return to the thread, which takes the interrupt and then
+ * executes the system call again.  The idle thread's trap is restarted
+ * in the same way.
+ *-----------------------------------------------------------------------*/
+#define PREEMPTSTEPS 16         // Number of steps between interrupt checks
+
+static bool     restartable = 0;
+static unsigned steps;
+
+void allowRestart(bool allow) {
+  restartable = allow;
+  steps       = 0;
+}
+
+void preemptionPoint() {
+  if (restartable && ++steps>=PREEMPTSTEPS) {
+    steps = 0;
+    if (pendingIRQ()) {
+DEBUG(printf("preempting thread %x at eip=%x\n", current->tid, current->context.iret.eip);)
+      restartable = 0;
+      cancelReservations();
+      refreshSpace();
+      current->context.iret.eip -= 2;  // Back to the int $n instruction
+      resume();
+    }
+  }
+}
+
 /*-------------------------------------------------------------------------
  * Timeslice accounting:
  *-----------------------------------------------------------------------*/
@@ -237,8 +476,7 @@ unsigned clockTick          = 1000000/HZ;  // TODO: is this ok?
 unsigned long long sysClock = 0;
 
 ENTRY timerInterrupt() {
-  maskAckIRQ(TIMERIRQ);           // Mask and acknowledge timer interrupt
-  enableIRQ(TIMERIRQ);		  // TODO: can this be optimized?
+  ackIRQ(TIMERIRQ);               // Acknowledge timer interrupt
   sysClock += clockTick;          // Update system clock
 
   if (holder->timeslice != 0) {          // finite timeslice; do accounting
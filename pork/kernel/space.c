@@ -24,24 +24,173 @@
 #include "pork.h"
 #include "memory.h"
 #include "space.h"
+#include "context.h"
+#include "hardware.h"
 
 #define DEBUG(cmd)	/*cmd*/
 
 struct Space {                  // Structure known only in this module
   unsigned        pdir;         // Physical address of page directory
   struct Mapping* mem;		// Memory map
+  struct MappingPage* nodes;    // Partly filled pages of Mappings
   Fpage           kipArea;      // Location of kernel interface page
   Fpage           utcbArea;     // Location of UCTBs
-  unsigned        count;        // Count of threads in this space
-  unsigned        active;       // Count of active threads in this space
-  unsigned        loaded;       // 1 => already loaded in cr3
+  unsigned short  count;        // Count of threads in this space
+  unsigned short  active;       // Count of active threads in this space
+  unsigned        quota     : 21; // Limit on kernel memory (in pages)
+  unsigned        small     : 5;  // Small space slot number + 1, or 0
+  unsigned        wantSmall : 1;  // 1 => place in a small space slot
+  unsigned        dying     : 1;  // 1 => waiting for deferred teardown
+  unsigned        used;         // Kernel memory charged to this space
 };
 
+#define NOQUOTA (1<<(32-PAGESIZE))  // Quota value for "no limit"
+
+/*-------------------------------------------------------------------------
+ * Only the current space can be loaded in cr3, so we use a single flag,
+ * rather than one per space, to record whether changes to its page table
+ * structures require a reload.  Changes to any other space need no
+ * action at all: its stale TLB entries are discarded when cr3 is loaded
+ * on the next switch to that space.  (Kernel mappings are global, so
+ * they survive a reload.)
+ */
+static struct Space* currentSpace = 0;
+static unsigned      loaded       = 0;  // 1 => currentSpace loaded in cr3
+
+static inline void changedSpace(struct Space* space) {
+  if (space==currentSpace) {
+    loaded = 0;       // Force page directory register (cr3) reload
+  }
+}
+
+/*-------------------------------------------------------------------------
+ * Return the linear address at which the small space slot with the given
+ * number (counting from 1) begins.  The pages of a small space are
+ * mapped in every page directory, so entries for them may be in the TLB
+ * whichever page directory is loaded.
+ */
+static inline unsigned smallBase(unsigned small) {
+  return SMALLSPACES + ((small-1)<<SUPERSIZE);
+}
+
+/*-------------------------------------------------------------------------
+ * Force a flush of all TLB entries for the given space before any of its
+ * threads next run.
+ */
+static inline void flushSpace(struct Space* space) {
+  if (space==currentSpace || space->small) {
+    loaded = 0;
+  }
+}
+
+static inline void invlpg(unsigned addr) {
+  asm volatile("  invlpg  (%0)\n" : : "r"(addr) : "memory");
+}
+
+#define INVLPGBITS 5  // Flush up to 2^INVLPGBITS pages before reloading cr3
+
+/*-------------------------------------------------------------------------
+ * Invalidate any TLB entries for the fpage with the given base and size
+ * in the specified space.  This uses invlpg, one (super)page at a time,
+ * for small changes to the current space, but falls back to a deferred
+ * cr3 reload for larger ones.
+ */
+static void invalidate(struct Space* space, unsigned base, unsigned size) {
+  unsigned step = (size>=SUPERSIZE) ? SUPERSIZE : PAGESIZE;
+  if (space->small) {
+    base += smallBase(space->small);
+  } else if (space!=currentSpace || !loaded) {
+    return;
+  }
+  if (size-step > INVLPGBITS) {
+    loaded = 0;
+  } else {
+    for (unsigned n=1<<(size-step); n>0; n--, base+=(1<<step)) {
+      invlpg(base);
+    }
+  }
+}
+
+/*-------------------------------------------------------------------------
+ * Kernel memory quotas:
+ *
+ * Each space is charged for the kernel memory that is allocated on its
+ * behalf (its page directory, page tables, and utcb pages; the Mapping
+ * objects in its memory map; and the TCBs for its threads), and the
+ * charge is refunded when that memory is freed.  Operations that might
+ * allocate memory for a space take their reservation from reserveSpace(),
+ * which fails if the worst case would take the space over its quota, so
+ * that one space cannot exhaust the memory that others depend on.
+ *-----------------------------------------------------------------------*/
+
+static void finishSpace(struct Space* space);   // (see "Deferred address
+                                                // space teardown" below)
+
+/*-------------------------------------------------------------------------
+ * Reserve n pages for an operation on behalf of the given space.  A null
+ * space (used for a space that is not allocated until the operation runs)
+ * is not subject to any quota.  Pages that are still held by dying spaces
+ * are not reclaimed here: that would be unbounded work in the middle of
+ * an operation, so the reservation fails, and the pages are returned to
+ * the free list by the idle thread (see "Deferred address space teardown").
+ */
+static inline bool withinQuota(struct Space* space, unsigned bytes) {
+  return !space || (space->used <= getQuota(space)
+                    && bytes <= getQuota(space) - space->used);
+}
+
+bool reserveSpace(struct Reservation* r, struct Space* space, unsigned n) {
+  if (!withinQuota(space, n<<PAGESIZE)) {
+    r->pages = 0;
+    return 0;
+  }
+  return reservePages(r, n);
+}
+
+void chargeSpace(struct Space* space, unsigned bytes) {
+  space->used += bytes;
+}
+
+/*-------------------------------------------------------------------------
+ * Charge a space for memory that comes from pages the kernel already
+ * holds, returning false, with no charge made, if that would take the
+ * space over its quota.
+ */
+bool tryChargeSpace(struct Space* space, unsigned bytes) {
+  if (!withinQuota(space, bytes)) {
+    return 0;
+  }
+  chargeSpace(space, bytes);
+  return 1;
+}
+
+void refundSpace(struct Space* space, unsigned bytes) {
+  space->used -= bytes;
+}
+
+unsigned getQuota(struct Space* space) {
+  return (space->quota==NOQUOTA) ? ~0 : (space->quota<<PAGESIZE);
+}
+
+void setQuota(struct Space* space, unsigned quota) {
+  space->quota = (quota==~0U) ? NOQUOTA : (quota>>PAGESIZE);
+}
+
+static void* allocSpacePage1(struct Reservation* r, struct Space* space) {
+  space->used += (1<<PAGESIZE);
+  return allocPage1(r);
+}
+
+static void freeSpacePage(struct Space* space, void* page) {
+  space->used -= (1<<PAGESIZE);
+  freePage(page);
+}
+
 /*-------------------------------------------------------------------------
- * Our implementation uses two kinds of objects, one to represent
- * complete address spaces (struct Space) and one to represent
- * individual memory mappings (struct Mapping).  These are both small
- * objects (less than 32 bytes or 8 words each).  We use ObjectPage
+ * Our implementation uses Objects, which are small (32 bytes or 8 words
+ * each), for the top level of PAE page directories.  (Address spaces,
+ * struct Space, and memory mappings, struct Mapping, are allocated
+ * separately; see below.)  We use ObjectPage
  * structures, each of which takes a 4K page of kernel memory, to
  * support dynamic allocation (and deallocation) of these Objects.
  * Each ObjectPage includes, along with header information, an array
@@ -77,13 +226,14 @@ struct ObjectPage {
   struct Object      blocks[FULL];
 };
 
+#ifdef PAE
 static struct ObjectPage* partials = 0;
 
 /*-------------------------------------------------------------------------
  * Allocate a single Object, either from the list of partially filled
  * pages or, if necessary, by allocating a new page of kernel memory.
  */
-static struct Object* allocObject1() {
+static struct Object* allocObject1(struct Reservation* r) {
   if (partials) {		// There are partially filled pages
     struct Object* obj = partials->free;
     if (obj) {			// Try to allocate from free list
@@ -99,7 +249,7 @@ static struct Object* allocObject1() {
     }
     return obj;
   } else {			// Need to allocate a new page
-    partials = (struct ObjectPage*)allocPage1();
+    partials = (struct ObjectPage*)allocPage1(r);
     partials->prev  = 0;
     partials->next  = 0;
     partials->free  = 0;
@@ -142,6 +292,103 @@ static void freeObject(struct Object* obj) {
     freePage(objp);
   }
 }
+#endif
+
+/*-------------------------------------------------------------------------
+ * Address space identifiers:
+ *
+ * Each Space has a 12 bit address space identifier (ASID) that can be
+ * used as a short, dense key in place of a struct Space pointer.  The
+ * upper ASIDHIBITS of an ASID select one of the pools in asidPools, and
+ * the lower ASIDLOBITS select a slot in that pool.  Each pool is a single
+ * 4K page that holds the Space structures themselves, so the ASID of a
+ * Space can be calculated from its address.  Slot 0 of each pool is used
+ * for the pool header, so 0 is never a valid ASID.  Pools are allocated on
+ * demand, and freed again when their last Space is released.  New Spaces
+ * always take the lowest free ASID, which keeps the set of ids dense.
+ *-----------------------------------------------------------------------*/
+#define ASIDHIBITS 5                    // Number of bits to select a pool
+#define ASIDLOBITS 7                    // Number of bits to select a slot
+#define ASIDPOOLS  (1<<ASIDHIBITS)      // Maximum number of ASID pools
+#define ASIDSLOTS  (1<<ASIDLOBITS)      // Slots per pool (including header)
+
+struct ASIDPool {               // A page of Spaces
+  unsigned     hi;              // Index of this pool in asidPools
+  unsigned     count;           // Number of Spaces allocated in this pool
+  unsigned     live[ASIDSLOTS/32]; // Bitmap of slots in use (0 => header)
+  unsigned     pad[2];
+  struct Space spaces[ASIDSLOTS-1];
+};
+
+static struct ASIDPool* asidPools[ASIDPOOLS];
+
+/*-------------------------------------------------------------------------
+ * Return the ASID for a given space.
+ */
+unsigned spaceASID(struct Space* space) {
+  struct ASIDPool* pool = (struct ASIDPool*)align((unsigned)space, PAGESIZE);
+  return (pool->hi<<ASIDLOBITS)
+       | (((unsigned)space - (unsigned)pool) / sizeof(struct Space));
+}
+
+/*-------------------------------------------------------------------------
+ * Find the index of the first pool that has room for another Space,
+ * returning ASIDPOOLS if all of the ASIDs are in use.
+ */
+static unsigned freePool() {
+  unsigned hi = 0;
+  while (hi<ASIDPOOLS && asidPools[hi] && asidPools[hi]->count==ASIDSLOTS-1) {
+    hi++;
+  }
+  return hi;
+}
+
+/*-------------------------------------------------------------------------
+ * Determine whether there is a free ASID for a new space.
+ */
+bool availableASID() {
+  return freePool()<ASIDPOOLS;
+}
+
+/*-------------------------------------------------------------------------
+ * Allocate storage for a Space with the lowest free ASID.  The caller is
+ * responsible for checking that there is a free ASID.
+ */
+static struct Space* allocASID1(struct Reservation* r) {
+  unsigned         hi   = freePool();
+  ASSERT(hi<ASIDPOOLS, "No free ASIDs");
+  struct ASIDPool* pool = asidPools[hi];
+  if (!pool) {                  // Need to allocate a new pool
+    pool = asidPools[hi] = (struct ASIDPool*)allocPage1(r);
+    pool->hi    = hi;
+    pool->count = 0;
+    for (unsigned i=0; i<ASIDSLOTS/32; i++) {
+      pool->live[i] = 0;
+    }
+    pool->live[0] = 1;          // Slot 0 holds the header
+  }
+  unsigned lo = 0;
+  while (pool->live[lo/32] & (1<<(lo%32))) {
+    lo++;
+  }
+  pool->live[lo/32] |= (1<<(lo%32));
+  pool->count++;
+  return pool->spaces + (lo-1);
+}
+
+/*-------------------------------------------------------------------------
+ * Release the ASID (and the storage) for a Space that is no longer in
+ * use, deallocating the underlying pool if it is now empty.
+ */
+static void freeASID(struct Space* space) {
+  struct ASIDPool* pool = (struct ASIDPool*)align((unsigned)space, PAGESIZE);
+  unsigned         lo   = mask(spaceASID(space), ASIDLOBITS);
+  pool->live[lo/32] &= ~(1<<(lo%32));
+  if (--pool->count==0) {
+    asidPools[pool->hi] = 0;
+    freePage(pool);
+  }
+}
 
 /*-------------------------------------------------------------------------
  * Mapping database structures:
@@ -158,47 +405,211 @@ static void freeObject(struct Object* obj) {
  * traversal.  Each node includes a level, which indicates its depth
  * from the root: the root has level 0, children of the root have
  * level 1, and so on.
- * 
+ *
+ * The root of the tree is sigma0's mapping of the complete address space,
+ * but it is not included in sigma0's memory map.  Instead, sigma0's map
+ * contains a "frame node" for each region of memory that sigma0 has
+ * mapped to other spaces, all of which are children of the root.  Because
+ * sigma0's address space is an idempotent mapping of physical memory, its
+ * memory map is also an index, by physical address, of the mapping
+ * database: every mapping of a given frame is a descendant of the single
+ * frame node that contains it, which can be found in O(log n) time.
+ *
  * 2) To describe the virtual addresses that are mapped in each address
  * space.  Conceptually, we can describe the mappings in an address
  * space by a set of disjoint intervals in virtual memory, but we will
- * actually represent these sets using binary search trees so that
- * they can be searched more efficiently.  (At some point, we should
- * switch to a balanced binary tree structure---such as red-black or AVL
- * trees---stealing a few bits from the level field to store whatever
- * balance information is needed.)  These trees are represented using
- * the left and right links, and we store a pointer to the root of each
- * tree in the corresponding address space.
+ * actually represent these sets using AVL trees so that they can be
+ * searched in O(log n) time, even when a pager maps pages in ascending
+ * address order (as sigma0 does).  Each node includes a balance factor
+ * (the height of its right subtree minus the height of its left subtree,
+ * always -1, 0, or 1).  These trees are represented using the left and
+ * right links, and we store a pointer to the root of each tree in the
+ * corresponding address space.
+ *
+ * To keep each Mapping down to 24 bytes, the physical page frame number
+ * (which fits in 20 bits), level, and balance factor share a single word,
+ * and there is no pointer to the address space that contains a Mapping.
+ * (In PAE builds, frame numbers can be larger than 20 bits, so the frame
+ * number has a word of its own, and each Mapping takes 28 bytes.)
+ * Instead, Mappings are allocated from pages that each belong to a single
+ * space, so the space can be found in the header of the page.
  *-----------------------------------------------------------------------*/
 
 struct Mapping {
-  struct Space*   space;	// Which address space is this in?
   struct Mapping* next;
   struct Mapping* prev;
-  unsigned        level;
-  Fpage           vfp;		// Virtual fpage
-  unsigned        phys;		// Physical address
   struct Mapping* left;
   struct Mapping* right;
+  Fpage           vfp;		// Virtual fpage
+#ifdef PAE
+  unsigned        phys;         // Physical page frame number
+  unsigned        level : 10;
+#else
+  unsigned        phys  : 20;   // Physical page frame number
+  unsigned        level : 10;
+#endif
+  signed          bal   : 2;    // AVL balance factor
+};
+
+#define MAXLEVEL ((1<<10)-1)    // Largest level in the mapping database
+
+#define MAPPINGS (((1<<PAGESIZE)-24)/sizeof(struct Mapping))
+                                // Number of Mappings per MappingPage
+
+struct MappingPage {            // A page of Mappings for a single space
+  struct Space*       owner;
+  struct MappingPage* prev;     // Doubly linked list of partly filled
+  struct MappingPage* next;     // MappingPages for the owner
+  unsigned            count;    // Number of active Mappings in this page
+  struct Mapping*     free;     // ptr to first Mapping in the free list
+  struct Mapping*     last;     // addr of last Mapping that we allocated
+  struct Mapping      nodes[MAPPINGS];
 };
 
 /*-------------------------------------------------------------------------
- * Look for a mapping within the given fpage of a particular space.
- * Return a NULL pointer if no mapping can be found.
+ * Allocate a single Mapping for the given space, using the same strategy
+ * as allocObject1() but with a separate list of partly filled pages for
+ * each space.  Pages of Mappings are charged to the space as a whole.
+ */
+static struct Mapping* allocMapping1(struct Reservation* r,
+                                     struct Space* space) {
+  struct MappingPage* mp = space->nodes;
+  struct Mapping*     m;
+  if (mp) {                     // There are partially filled pages
+    if ((m=mp->free)) {         // Try to allocate from free list
+      mp->free = m->next;
+    } else {                    // Initialize next node in this page
+      m = ++mp->last;
+    }
+    if (++mp->count==MAPPINGS) {// If page is full, remove it from partials
+      if ((space->nodes = mp->next)) {
+        space->nodes->prev = 0;
+      }
+    }
+  } else {                      // Need to allocate a new page
+    space->nodes = mp = (struct MappingPage*)allocSpacePage1(r, space);
+    mp->owner = space;
+    mp->prev  = 0;
+    mp->next  = 0;
+    mp->free  = 0;
+    mp->count = 1;
+    m = mp->last = mp->nodes;
+  }
+  return m;
+}
+
+/*-------------------------------------------------------------------------
+ * Deallocate a single Mapping, freeing the page that contained it if this
+ * was the last active Mapping in that page.
+ */
+static void freeMapping(struct Mapping* m) {
+  struct MappingPage* mp    = (struct MappingPage*)align((unsigned)m, 12);
+  struct Space*       space = mp->owner;
+  if (--mp->count>0) {
+    if (mp->count==MAPPINGS-1) {// Is a full page is becoming partial?
+      mp->prev = 0;
+      mp->next = space->nodes;
+      if (space->nodes) {
+        space->nodes->prev = mp;
+      }
+      space->nodes = mp;
+    }
+    m->next  = mp->free;        // Add m to the free list for mp
+    mp->free = m;
+  } else {                      // m was the last active Mapping in mp
+    if (mp->prev) {
+      mp->prev->next = mp->next;
+    } else {
+      space->nodes   = mp->next;
+    }
+    if (mp->next) {
+      mp->next->prev = mp->prev;
+    }
+    freeSpacePage(space, mp);
+  }
+}
+
+/*-------------------------------------------------------------------------
+ * Return the address space that contains a given Mapping.
+ */
+static inline struct Space* mappingSpace(struct Mapping* m) {
+  return ((struct MappingPage*)align((unsigned)m, 12))->owner;
+}
+
+static struct Mapping* rootMapping;     // Root of the mapping database
+
+/*-------------------------------------------------------------------------
+ * Look for a mapping within the range of virtual addresses [lo,hi] in a
+ * particular space, returning the mapping with the highest address if
+ * there is more than one.  Return a NULL pointer if no mapping can be
+ * found.
  */
-static struct Mapping* findMapping(struct Space* space, Fpage vfp) {
+static struct Mapping* findRange(struct Space* space,
+                                 unsigned lo, unsigned hi) {
   struct Mapping* m     = space->mem;
   struct Mapping* cand  = 0;
-  unsigned        fpend = fpageEnd(vfp);
   while (m) {
-    if (fpend < fpageStart(m->vfp)) {
+    if (hi < fpageStart(m->vfp)) {
       m = m->left;
     } else {
       cand = m;
       m    = m->right;
     }
   }
-  return (cand && fpageStart(vfp)<fpageEnd(cand->vfp)) ? cand : 0;
+  return (cand && lo<fpageEnd(cand->vfp)) ? cand : 0;
+}
+
+/*-------------------------------------------------------------------------
+ * Look for a mapping within the given fpage of a particular space.
+ * Return a NULL pointer if no mapping can be found.
+ */
+static inline struct Mapping* findMapping(struct Space* space, Fpage vfp) {
+  return findRange(space, fpageStart(vfp), fpageEnd(vfp));
+}
+
+/*-------------------------------------------------------------------------
+ * Rebalance an AVL subtree rooted at m, whose balance factor would
+ * otherwise be b (either -2 or 2), by performing a single or double
+ * rotation, and returning the new root of the subtree.
+ */
+#define MAXHEIGHT 48    // Bound on AVL tree height (> 1.44*log2(#Objects))
+
+static struct Mapping* rebalance(struct Mapping* m, int b) {
+  struct Mapping* c = (b>0) ? m->right : m->left;   // taller child
+  int             d = (b>0) ? 1 : (-1);             // direction of lean
+  if (c->bal==-d) {                   // Double rotation:
+    struct Mapping* g = (b>0) ? c->left : c->right; // grandchild
+    if (b>0) {
+      c->left  = g->right;
+      m->right = g->left;
+      g->left  = m;
+      g->right = c;
+    } else {
+      c->right = g->left;
+      m->left  = g->right;
+      g->right = m;
+      g->left  = c;
+    }
+    m->bal = (g->bal==d)  ? (-d) : 0;
+    c->bal = (g->bal==-d) ? d    : 0;
+    g->bal = 0;
+    return g;
+  } else {                            // Single rotation:
+    if (b>0) {
+      m->right = c->left;
+      c->left  = m;
+    } else {
+      m->left  = c->right;
+      c->right = m;
+    }
+    if (c->bal==0) {                  // (only possible after a removal)
+      m->bal = d;
+      c->bal = -d;
+    } else {
+      m->bal = c->bal = 0;
+    }
+    return c;
+  }
 }
 
 /*-------------------------------------------------------------------------
@@ -208,17 +619,38 @@ static struct Mapping* findMapping(struct Space* space, Fpage vfp) {
  * space, and that vfp has non-zero permissions (or else this mapping
  * would not be useful).
  */
-static struct Mapping* addMapping1(struct Space* space, Fpage vfp) {
+static struct Mapping* addMapping1(struct Reservation* r,
+                                   struct Space* space, Fpage vfp) {
   unsigned         base = fpageStart(vfp);
+  struct Mapping** path[MAXHEIGHT];   // links to each ancestor of new node
+  unsigned         d    = 0;
   struct Mapping** pm   = &space->mem;
   struct Mapping*  m;
   while ((m=*pm)) {
+    path[d++] = pm;
     pm = (base<fpageStart(m->vfp)) ? (&m->left) : (&m->right);
   }
-  *pm      = m = (struct Mapping*)allocObject1();
-  m->space = space;
+  *pm      = m = allocMapping1(r, space);
   m->vfp   = vfp;
+  m->bal   = 0;
   m->left  = m->right = 0;
+
+  // Retrace the path back towards the root, updating balance factors
+  // for as long as the height of the subtree that we came from has grown:
+  struct Mapping* n = m;
+  while (d>0) {
+    struct Mapping** pa = path[--d];
+    struct Mapping*  a  = *pa;
+    int              b  = a->bal + ((n==a->left) ? (-1) : 1);
+    if (b==2 || b==(-2)) {
+      *pa = rebalance(a, b);          // restores original subtree height
+      break;
+    }
+    if ((a->bal=b)==0) {              // subtree height is unchanged
+      break;
+    }
+    n = a;
+  }
   return m;
 }
 
@@ -227,40 +659,143 @@ static struct Mapping* addMapping1(struct Space* space, Fpage vfp) {
  * that the mapping was previously added to the space using addMapping1.
  */
 static void removeMapping(struct Mapping* n) {
-  struct Space*    space = n->space;
+  struct Space*    space = mappingSpace(n);
   unsigned         base  = fpageStart(n->vfp);
+  struct Mapping** path[MAXHEIGHT];   // links to ancestors of removed slot
+  unsigned         d     = 0;
   struct Mapping** pn    = &space->mem;
+  struct Mapping** pl;                // link to subtree that has shrunk
   struct Mapping*  m;
   while ((m=*pn)!=n) {
+    path[d++] = pn;
     pn = (base<fpageStart(m->vfp)) ? (&m->left) : (&m->right);
   }
   // Now pn holds a pointer to n, which is the node that we want to delete.
   if (n->left==0) {          // left child of n is empty
-    *pn = n->right;
+    *(pl = pn) = n->right;
   } else if (n->right==0) {  // right child of n is empty
-    *pn = n->left;
+    *(pl = pn) = n->left;
   } else {                   // neither child is empty
+    path[d++] = pn;          // m will take the place of n at *pn ...
+    unsigned         k  = d; // ... so path[k] will be &m->right
     struct Mapping** pm = &n->right;
     while ((m=*pm)->left) {  // find leftmost node on right
+      path[d++] = pm;
       pm = &m->left;
     }
     *pm      = m->right;     // unlink m from right of tree
     *pn      = m;            // and use it to replace n
     m->left  = n->left;
-    m->right = m->right;
+    m->right = n->right;
+    m->bal   = n->bal;
+    if (pm==&n->right) {     // m was the right child of n
+      pl = &m->right;
+    } else {
+      pl      = pm;
+      path[k] = &m->right;
+    }
+  }
+
+  // Retrace the path back towards the root, updating balance factors
+  // for as long as the height of the subtree that we came from has shrunk:
+  while (d>0) {
+    struct Mapping** pa = path[--d];
+    struct Mapping*  a  = *pa;
+    int              b  = a->bal + ((pl==&a->left) ? 1 : (-1));
+    if (b==2 || b==(-2)) {
+      struct Mapping* c = (b>0) ? a->right : a->left;
+      int             e = c->bal;
+      *pa = rebalance(a, b);
+      if (e==0) {                     // subtree height is unchanged
+        break;
+      }
+    } else if ((a->bal=b)!=0) {       // subtree height is unchanged
+      break;
+    }
+    pl = pa;
   }
 }
 
 /*-------------------------------------------------------------------------
  * Page directories and page tables:
+ *
+ * With classic 32 bit paging, a page directory is a single page of 1024
+ * entries, each of which maps a 4MB superpage or points to a page table.
+ * With PAE paging (build with -DPAE), cr3 instead points to a four entry
+ * page directory pointer table (which we allocate as an Object, meeting
+ * the 32 byte alignment requirement), each entry of which points to a
+ * page directory of 512 entries, mapping 2MB superpages or page tables.
+ * The page directory for the kernel portion (the top 1GB) is shared by
+ * every address space.  In both cases, we use pdirSlot(pdir, i) to
+ * access the ith of the PDENTRIES slots, each covering (1<<SUPERSIZE)
+ * bytes of the virtual address space.
  *-----------------------------------------------------------------------*/
 
-struct Pdir { unsigned pde[1024]; };
-struct Ptab { unsigned pte[1024]; };
+struct Ptab { Pte pte[1<<PTBITS]; };
+#ifdef PAE
+struct Pdir { Pte pdpte[4]; };
+
+static inline Pte* pdirSlot(struct Pdir* pdir, unsigned i) {
+  return fromPhys(Pte*, align((unsigned)pdir->pdpte[i>>PTBITS], PAGESIZE))
+       + mask(i, PTBITS);
+}
+
+static Pte nxbit = 0;   // Execute disable bit, if supported by the cpu
+#else
+struct Pdir { Pte pde[PDENTRIES]; };
+
+static inline Pte* pdirSlot(struct Pdir* pdir, unsigned i) {
+  return pdir->pde + i;
+}
+#endif
 
 unsigned*           utcbptr;
 static struct Ptab* utcbPtab;
 
+/*-------------------------------------------------------------------------
+ * The TCB array:
+ *
+ * TCBs are stored in a virtual array at TCBSPACE in the kernel's part of
+ * every address space, indexed directly by thread number.  The page
+ * tables for the array are allocated at boot and shared by every page
+ * directory, but each page of the array is only backed by memory of its
+ * own while it holds at least one TCB.  The others are all mapped, read
+ * only, to a single page of zeros, so that a lookup can read any TCB in
+ * the array, and will find a null space field for an unused thread.
+ *-----------------------------------------------------------------------*/
+#define TCBPTABS ((1<<(THREADBITS+TCBSIZE))>>SUPERSIZE) // # of page tables
+
+static struct Ptab* tcbPtabs[TCBPTABS];
+static unsigned     nullPage;   // Physical address of the page of zeros
+
+static inline Pte* tcbPte(void* addr) {
+  unsigned page = ((unsigned)addr - TCBSPACE)>>PAGESIZE;
+  return tcbPtabs[page>>PTBITS]->pte + mask(page, PTBITS);
+}
+
+/*-------------------------------------------------------------------------
+ * Make sure that the page of the TCB array containing addr is backed by
+ * its own (zero filled) page of memory.
+ */
+void allocTCBPage1(struct Reservation* r, void* addr) {
+  Pte* pte = tcbPte(addr);
+  if (align((unsigned)*pte, PAGESIZE)==nullPage) {
+    *pte = toPhys(allocPage1(r)) | PERMS_KERNEL_RW;
+    invlpg(align((unsigned)addr, PAGESIZE));
+  }
+}
+
+/*-------------------------------------------------------------------------
+ * Release the memory for a page of the TCB array once it holds no TCBs.
+ */
+void freeTCBPage(void* addr) {
+  Pte* pte = tcbPte(addr);
+  Pte  old = *pte;
+  *pte     = nullPage | PERMS_KERNEL_RO;
+  invlpg(align((unsigned)addr, PAGESIZE));
+  freePage(fromPhys(void*, align((unsigned)old, PAGESIZE)));
+}
+
 /*-------------------------------------------------------------------------
  * Set the page directory control register to a specific value.
  */
@@ -273,53 +808,284 @@ static inline void setPdir(unsigned pdir) {
  * pdir, or NULL if it is not present (0x1) or is a super page (0x80).
  */
 static inline struct Ptab* getPagetab(struct Pdir* pdir, unsigned i) {
-  return ((pdir->pde[i]&0x81)==0x1)
-          ? fromPhys(struct Ptab*, align(pdir->pde[i], PAGESIZE)) : 0;
+  Pte pde = *pdirSlot(pdir, i);
+  return ((pde&0x81)==0x1)
+          ? fromPhys(struct Ptab*, align((unsigned)pde, PAGESIZE)) : 0;
 }
 
 /*-------------------------------------------------------------------------
  * Return a pointer to the page for the ith entry of the specified ptab,
- * or NULL if it is not present (0x1).
+ * or NULL if it is not present (0x1).  (Only used for kernel memory pages,
+ * which are always within the kernel window.)
  */
 static inline void* getPage(struct Ptab* ptab, unsigned i) {
   return (ptab->pte[i]&1)
-          ? fromPhys(void*, align(ptab->pte[i], PAGESIZE)) : 0;
+          ? fromPhys(void*, align((unsigned)ptab->pte[i], PAGESIZE)) : 0;
+}
+
+/*-------------------------------------------------------------------------
+ * Shared page tables:
+ *
+ * Spaces that run the same program often end up with identical page
+ * tables: the same frames, with the same access rights, at the same
+ * addresses.  When map2() leaves a page table that is identical (apart
+ * from accessed and dirty bits) to the table for the same slot in a
+ * space that holds a sibling mapping, both page directory entries are
+ * pointed at a single table, marked with PERMS_SHARED, and a count of
+ * its users is kept in sharedPtabs[].  Every user is still charged for
+ * a page table, so that unsharing cannot take a space over its quota.
+ *
+ * A shared table is never changed through one of its users.  A new
+ * mapping in the slot takes a private copy of the table, using the page
+ * that mapFpage1() would otherwise have used for a new table.  Unmapping
+ * and protection changes cannot allocate memory, so they drop the space's
+ * reference instead, leaving the slot empty, and the table is refilled
+ * from the space's memory map the next time that one of its threads
+ * faults on an address in the slot.  Accessed and dirty bits in a shared
+ * table are only collected, never reset, so Unmap may report them when
+ * they are not strictly needed, and the Mappings in a dropped slot are
+ * marked STALE until their (unknown) status bits have been reported.
+ *-----------------------------------------------------------------------*/
+#define NUMSHARED  64           // Maximum number of shared page tables
+#define SHARETRIES 4            // Maximum number of tables compared
+#define SHAREVISITS 64          // Maximum number of nodes visited
+#define STALE      0x8          // (Unused fpage bit) status bits lost
+
+struct SharedPtab {
+  struct Ptab* ptab;            // Shared page table, or null
+  unsigned     refs;            // Number of page directories using ptab
+};
+
+static struct SharedPtab sharedPtabs[NUMSHARED];
+
+static inline bool sharedSlot(struct Pdir* pdir, unsigned i) {
+  return (*pdirSlot(pdir, i) & (PERMS_SHARED|0x81)) == (PERMS_SHARED|1);
+}
+
+static struct SharedPtab* findShared(struct Ptab* ptab) {
+  for (unsigned k=0; k<NUMSHARED; k++) {
+    if (sharedPtabs[k].ptab==ptab) {
+      return sharedPtabs + k;
+    }
+  }
+  return 0;
+}
+
+/*-------------------------------------------------------------------------
+ * Determine whether the ith slot of a space can use a shared page table:
+ * we do not share slots that hold the kip, utcbs, or a small space, or
+ * any part of sigma0, whose page tables are updated by sigma0map().
+ */
+static bool shareable(struct Space* space, unsigned i) {
+  return space!=sigma0Space
+      && space->pdir
+      && !space->dying
+      && !(space->small && i==0)
+      && (space->kipArea>>SUPERSIZE != i)
+      && (space->utcbArea>>SUPERSIZE != i);
+}
+
+/*-------------------------------------------------------------------------
+ * Return true if the ith slot of the given page directory holds a private
+ * page table (or none at all).  A shared table whose only remaining user
+ * is this page directory is made private again.
+ */
+static bool privateSlot(struct Pdir* pdir, unsigned i) {
+  if (sharedSlot(pdir, i)) {
+    struct SharedPtab* sh = findShared(getPagetab(pdir, i));
+    if (sh->refs>1) {
+      return 0;
+    }
+    sh->ptab            = 0;
+    *pdirSlot(pdir, i) &= ~(Pte)PERMS_SHARED;
+  }
+  return 1;
+}
+
+/*-------------------------------------------------------------------------
+ * Replace a shared page table in the ith slot of a space with a private
+ * copy, returning the page table for the slot.  No charge is made for
+ * the new page, because the space is already charged for a table.
+ */
+static struct Ptab* copyShared1(struct Reservation* r, struct Space* space,
+                                struct Pdir* pdir, unsigned i) {
+  struct Ptab* shared = getPagetab(pdir, i);
+  if (privateSlot(pdir, i)) {
+    return shared;
+  }
+  struct Ptab* ptab = (struct Ptab*)allocPage1(r);
+  for (unsigned j=0; j<(1<<PTBITS); j++) {
+    ptab->pte[j] = shared->pte[j];
+  }
+  findShared(shared)->refs--;
+  *pdirSlot(pdir, i) = toPhys(ptab) | PERMS_USER_RW;
+  flushSpace(space);
+  return ptab;
+}
+
+/*-------------------------------------------------------------------------
+ * Drop a space's reference to the shared page table in its ith slot,
+ * marking the mappings that it had in the slot as STALE, and refunding
+ * the charge for the table.
+ */
+static void dropShared(struct Space* space, struct Pdir* pdir, unsigned i) {
+  unsigned        lo = i<<SUPERSIZE;
+  unsigned        hi = lo + ((1<<SUPERSIZE)-1);
+  struct Mapping* m;
+  while ((m=findRange(space, lo, hi))) {
+    m->vfp |= STALE;
+    if (fpageStart(m->vfp)<=lo) {
+      break;
+    }
+    hi = fpageStart(m->vfp)-1;
+  }
+  findShared(getPagetab(pdir, i))->refs--;
+  *pdirSlot(pdir, i) = 0;
+  space->used       -= (1<<PAGESIZE);
+  flushSpace(space);
+}
+
+/*-------------------------------------------------------------------------
+ * Test whether two page tables hold the same entries, ignoring accessed
+ * and dirty bits.
+ */
+static bool samePtab(struct Ptab* a, struct Ptab* b) {
+  for (unsigned j=0; j<(1<<PTBITS); j++) {
+    if ((a->pte[j] ^ b->pte[j]) & ~(Pte)0x60) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*-------------------------------------------------------------------------
+ * Share the page table in the ith slot of another space in place of the
+ * private page table for the same slot in the given space, if they hold
+ * the same entries, returning true if the table is shared.
+ */
+static bool joinPtab(struct Space* space, struct Space* other, unsigned i) {
+  struct Pdir*       pdir  = fromPhys(struct Pdir*, space->pdir);
+  struct Pdir*       opdir = fromPhys(struct Pdir*, other->pdir);
+  struct Ptab*       ptab;
+  struct Ptab*       optab;
+  struct SharedPtab* sh;
+  if (!shareable(space, i)
+   || !shareable(other, i)
+   || !(ptab=getPagetab(pdir, i))
+   || !(optab=getPagetab(opdir, i))
+   || sharedSlot(pdir, i)
+   || !samePtab(ptab, optab)) {
+    return 0;
+  }
+  if (sharedSlot(opdir, i)) {
+    sh = findShared(optab);
+  } else if ((sh=findShared(0))) {
+    sh->ptab             = optab;
+    sh->refs             = 1;
+    *pdirSlot(opdir, i) |= PERMS_SHARED;
+  } else {
+    return 0;                    // No room for another shared table
+  }
+  for (unsigned j=0; j<(1<<PTBITS); j++) {
+    optab->pte[j] |= ptab->pte[j] & 0x60;   // Keep our status bits
+  }
+  sh->refs++;
+  *pdirSlot(pdir, i) = toPhys(optab) | PERMS_USER_RW | PERMS_SHARED;
+  freePage(ptab);                // (but the space is still charged for it)
+  flushSpace(space);
+  return 1;
+}
+
+/*-------------------------------------------------------------------------
+ * Once a new mapping t, whose parent is s, has been entered in the page
+ * table for its slot, look for a sibling mapping at the same address in
+ * another space whose page table for the slot is the same, and, if we
+ * find one, share that table in place of our own.  The search stops after
+ * SHAREVISITS nodes, so that it does not have to walk every descendant of
+ * a widely mapped parent (such as a shared library page); new mappings are
+ * inserted just after their parent, so the most recent siblings, which are
+ * the most likely candidates, are examined first.
+ */
+static void sharePtab(struct Mapping* t, struct Mapping* s) {
+  struct Space* space  = mappingSpace(t);
+  unsigned      i      = fpageStart(t->vfp)>>SUPERSIZE;
+  unsigned      tries  = SHARETRIES;
+  unsigned      visits = SHAREVISITS;
+  if (fpageSize(t->vfp)>=SUPERSIZE || !shareable(space, i)) {
+    return;
+  }
+  for (struct Mapping* c=s->next; c && c->level>s->level && visits-- > 0;
+       c=c->next) {
+    struct Space* other = mappingSpace(c);
+    if (c->level==s->level+1
+     && c!=t
+     && fpageStart(c->vfp)==fpageStart(t->vfp)
+     && other!=space) {
+      if (joinPtab(space, other, i) || --tries==0) {
+        return;
+      }
+    }
+  }
+}
+
+/*-------------------------------------------------------------------------
+ * Calculate the page table entry for the first page of an fpage that is
+ * mapped to a given physical page frame.
+ */
+static inline Pte fpagePte(Fpage vfp, unsigned frame) {
+  Pte pte = ((Pte)align(frame, fpageSize(vfp)-PAGESIZE) << PAGESIZE)
+          | ((vfp & W) ? PERMS_USER_RW : PERMS_USER_RO);
+#ifdef PAE
+  if (!(vfp & X)) {
+    pte |= nxbit;
+  }
+#endif
+  return pte;
 }
 
 /*-------------------------------------------------------------------------
  * Allocate a page directory for a new address space.  The user portion of
  * the virtual address space is initially empty, except for a kip mapping,
- * and the first 512MB of physical memory is mapped into the kernel space.
+ * and the kernel portion shares the kernel window on physical memory (and
+ * the utcb pointer page) with the initial page directory.
  */
-static struct Pdir* allocPdir2(unsigned kipAddr) {
-  struct Pdir* pdir = (struct Pdir*)allocPage1();
-  unsigned     i    = 0;
-
-  // Zero out user portion of the address space
-  while (i<(KERNEL_SPACE>>SUPERSIZE)) {
-    pdir->pde[i++] = 0;
+static struct Pdir* allocPdir5(struct Reservation* r, struct Space* space) {
+  unsigned     kipAddr = fpageStart(space->kipArea);
+  unsigned     i       = 0;
+#ifdef PAE
+  struct Pdir* pdir    = (struct Pdir*)allocObject1(r);
+  space->used         += sizeof(struct Object);
+  while (i<(KERNEL_SPACE>>(SUPERSIZE+PTBITS))) {   // User page directories
+    pdir->pdpte[i++] = toPhys(allocSpacePage1(r, space)) | 1; // (empty)
   }
+  pdir->pdpte[i] = toPhys(initPdir + (KERNEL_SPACE>>SUPERSIZE)) | 1;
 
-  // Create a mapping for the first PHYSMAP bytes of physical memory
-  while (i<((KERNEL_SPACE+PHYSMAP)>>SUPERSIZE)) {
-    pdir->pde[i] = ((i<<SUPERSIZE) - KERNEL_SPACE) | PERMS_KERNELSPACE;
-    i++;
+  // Share the small space page tables with the initial page directory
+  for (i=SMALLSPACES>>SUPERSIZE; i<(KERNEL_SPACE>>SUPERSIZE); i++) {
+    *pdirSlot(pdir, i) = initPdir[i];
   }
+#else
+  struct Pdir* pdir    = (struct Pdir*)allocSpacePage1(r, space);
 
-  // Remaining portion of address space is also unmapped
-  while (i<1024) {
+  // Zero out user portion of the address space
+  while (i<(SMALLSPACES>>SUPERSIZE)) {
     pdir->pde[i++] = 0;
   }
 
-  // Add a 4K mapping for the UTCBPTR
-  pdir->pde[UTCBPTR>>SUPERSIZE] = toPhys(utcbPtab) | PERMS_USER_RW;
+  // Copy the small space and kernel window mappings from the initial
+  // page directory
+  while (i<PDENTRIES) {
+    pdir->pde[i] = initPdir[i];
+    i++;
+  }
+#endif
 
   // Add a 4K mapping for the kip
   if (kipAddr < KERNEL_SPACE) {
-    struct Ptab* ptab = (struct Ptab*)allocPage1();
-    pdir->pde[kipAddr>>SUPERSIZE]
+    struct Ptab* ptab = (struct Ptab*)allocSpacePage1(r, space);
+    *pdirSlot(pdir, kipAddr>>SUPERSIZE)
                       = toPhys(ptab) | PERMS_USER_RW;
-    ptab->pte[mask(kipAddr>>PAGESIZE, 10)]
+    ptab->pte[mask(kipAddr>>PAGESIZE, PTBITS)]
                       = toPhys(Kip)  | PERMS_USER_RO;
   }
   return pdir;
@@ -331,127 +1097,474 @@ static struct Pdir* allocPdir2(unsigned kipAddr) {
  * been removed (and hence that all page tables for user space mappings
  * have already been deallocated).
  */
-static void freePdir(struct Pdir* pdir, Fpage utcbArea) {
+static void freePdir(struct Space* space) {
+  struct Pdir* pdir = fromPhys(struct Pdir*, space->pdir);
+
+  // Make sure that the page directory is no longer in use:
+  if (space==currentSpace) {
+#ifdef PAE
+    setPdir(toPhys(initPdpt));
+#else
+    setPdir(toPhys(initPdir));
+#endif
+    currentSpace = 0;
+    loaded       = 1;
+  }
+
   // Free pages allocated to utcbs:
-  unsigned p = fpageStart(utcbArea) >> PAGESIZE;
-  unsigned e = fpageEnd(utcbArea)   >> PAGESIZE;
+  unsigned p = fpageStart(space->utcbArea) >> PAGESIZE;
+  unsigned e = fpageEnd(space->utcbArea)   >> PAGESIZE;
   while (p<=e) {
-    struct Ptab* ptab = getPagetab(pdir, p>>10);
+    struct Ptab* ptab = getPagetab(pdir, p>>PTBITS);
     if (ptab) {
       do {
-        void* pg = getPage(ptab, mask(p,10));
+        void* pg = getPage(ptab, mask(p,PTBITS));
         if (pg) {
-          freePage(pg);
+          freeSpacePage(space, pg);
         }
-      } while (++p<e && mask(p,10)!=0);
-    } else if ((p>>10) < (e>>10)) {
-        p += (1<<10);
+      } while (++p<e && mask(p,PTBITS)!=0);
+    } else if ((p>>PTBITS) < (e>>PTBITS)) {
+        p += (1<<PTBITS);
     } else {
       break;
     }
   }
 
   // Free pages used to map utcbs and the kip:
-  for (p=0; p<(KERNEL_SPACE>>SUPERSIZE); p++) {
+  for (p=0; p<(SMALLSPACES>>SUPERSIZE); p++) {
     // TODO: we could optimize this ... we only need to scan the
     // page directory slots for the utcbArea and kipArea ...
     struct Ptab* ptab = getPagetab(pdir, p);
-    if (ptab) {
-      freePage(ptab);
+    if (ptab && !privateSlot(pdir, p)) {
+      dropShared(space, pdir, p);
+    } else if (ptab) {
+      freeSpacePage(space, ptab);
     }
   }
 
-  // Free page used for the top-level page directory:
-  freePage(pdir);
+  // Free storage used for the top-level page directory:
+#ifdef PAE
+  for (p=0; p<(KERNEL_SPACE>>(SUPERSIZE+PTBITS)); p++) {
+    freeSpacePage(space,
+                  fromPhys(void*, align((unsigned)pdir->pdpte[p], PAGESIZE)));
+  }
+  freeObject((struct Object*)pdir);
+  space->used -= sizeof(struct Object);
+#else
+  freeSpacePage(space, pdir);
+#endif
+  space->pdir = 0;
 }
 
 /*-------------------------------------------------------------------------
  * Allocate a kernel mapped page to contain a utcb at the specified address
  * in the given page directory.
  */
-static void* allocUtcbPage2(struct Pdir* pdir, unsigned utcbAddr) {
-  unsigned i        = mask(utcbAddr>>SUPERSIZE, 10);
+static void* allocUtcbPage2(struct Reservation* r, struct Space* space,
+                            struct Pdir* pdir, unsigned utcbAddr) {
+  unsigned i        = utcbAddr>>SUPERSIZE;
   struct Ptab* ptab = getPagetab(pdir, i);
   if (!ptab) {                            // No page table at this addr
-    ptab         = (struct Ptab*)allocPage1();
-    pdir->pde[i] = align(toPhys(ptab), PAGESIZE) | PERMS_USER_RW;
+    ptab         = (struct Ptab*)allocSpacePage1(r, space);
+    *pdirSlot(pdir, i) = align(toPhys(ptab), PAGESIZE) | PERMS_USER_RW;
   }
-  void* page = getPage(ptab, i=mask(utcbAddr>>PAGESIZE, 10));
+  void* page = getPage(ptab, i=mask(utcbAddr>>PAGESIZE, PTBITS));
   if (!page) {                            // No page at this address
-    page         = (void*)allocPage1();
+    page         = (void*)allocSpacePage1(r, space);
     ptab->pte[i] = align(toPhys(page), PAGESIZE) | PERMS_USER_RW;
   }
   return (void*)(page + mask(utcbAddr, PAGESIZE));
 }
 
+/*-------------------------------------------------------------------------
+ * Small address spaces:
+ *
+ * The top NUMSMALL superpages of the user address space, beginning at
+ * SMALLSPACES, are divided into slots that can each hold a small address
+ * space.  The page table for each slot is shared by every page directory,
+ * and a space that is placed in a slot uses that page table in place of
+ * its own for virtual addresses [0, 1<<SUPERSIZE).  Its threads run with
+ * user segments that start at the base of the slot and are limited to a
+ * single superpage, so switching to a small space only requires the
+ * segment descriptors to be rewritten; there is no need to reload cr3 or
+ * to flush the TLB.  Large spaces run with segments whose limits exclude
+ * the small space region.
+ *-----------------------------------------------------------------------*/
+struct Slot {
+  struct Space* owner;          // Space in this slot, or null
+  struct Ptab*  window;         // Page table shared by all page directories
+  struct Ptab*  saved;          // Owner's page table while it is small
+};
+
+static struct Slot slots[NUMSMALL];
+
+extern unsigned long long gdt[];
+static unsigned segSlot = 0;    // Small slot number of user segments, or 0
+
+/*-------------------------------------------------------------------------
+ * Set the user code and data segment descriptors for the given small space
+ * slot (or for a large space, if small is 0).  These take effect when the
+ * segment registers are reloaded on the return to user mode.
+ */
+static void setSegments(unsigned small) {
+  if (small!=segSlot) {
+    unsigned base  = small ? smallBase(small) : 0;
+    unsigned limit = ((small ? (1<<SUPERSIZE) : SMALLSPACES)>>PAGESIZE) - 1;
+    unsigned long long desc
+      = ((unsigned long long)((base & 0xff000000) | (limit & 0xf0000)
+                              | ((base>>16) & 0xff)) << 32)
+      | (base<<16) | (limit & 0xffff);
+    gdt[(unsigned)USER_CS>>3] = desc | (0xc0fbULL<<40); // 4K granularity,
+    gdt[(unsigned)USER_DS>>3] = desc | (0xc0f3ULL<<40); // 32 bit, dpl=3
+    segSlot = small;
+  }
+}
+
+/*-------------------------------------------------------------------------
+ * Move an active space into a free small space slot, if it has one, and
+ * if its kip, utcb area, and all of its mappings lie within the first
+ * superpage of its address space.
+ */
+static void makeSmall(struct Space* space) {
+  struct Pdir* pdir = fromPhys(struct Pdir*, space->pdir);
+  struct Ptab* ptab = getPagetab(pdir, 0);
+  if (space->small
+   || !ptab                                 // (kip not mapped in window)
+   || (fpageEnd(space->kipArea)>>SUPERSIZE)
+   || (fpageEnd(space->utcbArea)>>SUPERSIZE)
+   || findRange(space, 1<<SUPERSIZE, SMALLSPACES-1)) {
+    return;
+  }
+  for (unsigned k=0; k<NUMSMALL; k++) {
+    if (!slots[k].owner) {
+      struct Ptab* window = slots[k].window;
+      for (unsigned i=0; i<(1<<PTBITS); i++) {
+        window->pte[i] = ptab->pte[i];
+        ptab->pte[i]   = 0;
+      }
+      slots[k].owner     = space;
+      slots[k].saved     = ptab;
+      *pdirSlot(pdir, 0) = toPhys(window) | PERMS_USER_RW;
+      space->small       = k+1;
+      changedSpace(space);
+      return;
+    }
+  }
+}
+
+/*-------------------------------------------------------------------------
+ * Return a small space to the normal, large space representation.  Its
+ * entries for the slot are copied back to the page table that was set
+ * aside by makeSmall(), so this never needs to allocate memory.
+ */
+static void makeLarge(struct Space* space) {
+  struct Slot* slot = slots + (space->small - 1);
+  struct Ptab* ptab = slot->saved;
+  for (unsigned i=0; i<(1<<PTBITS); i++) {
+    ptab->pte[i]         = slot->window->pte[i];
+    slot->window->pte[i] = 0;
+  }
+  *pdirSlot(fromPhys(struct Pdir*, space->pdir), 0)
+               = toPhys(ptab) | PERMS_USER_RW;
+  slot->owner  = 0;
+  slot->saved  = 0;
+  space->small = 0;
+  loaded       = 0;   // Remove stale entries for the slot from the TLB
+}
+
+/*-------------------------------------------------------------------------
+ * Request that a space be placed in a small space slot (or not).  The
+ * request is recorded for use when the space is next activated, and is
+ * also applied straight away if the space is already active.
+ */
+void setSmall(struct Space* space, bool small) {
+  space->wantSmall = small;
+  if (activeSpace(space)) {
+    if (small) {
+      makeSmall(space);
+    } else if (space->small) {
+      makeLarge(space);
+    }
+  }
+}
+
+/*-------------------------------------------------------------------------
+ * Respond to a general protection fault in the given space: if it was a
+ * small space, then it has probably run past the end of its segments, so
+ * we turn it into a large space and report true to have the faulting
+ * instruction retried.
+ */
+bool growSpace(struct Space* space) {
+  if (space->small) {
+    makeLarge(space);
+    return 1;
+  }
+  return 0;
+}
+
+/*-------------------------------------------------------------------------
+ * Return the linear address that corresponds to virtual address 0 in the
+ * given space.
+ */
+unsigned spaceBase(struct Space* space) {
+  return space->small ? smallBase(space->small) : 0;
+}
+
+/*-------------------------------------------------------------------------
+ * Superpage promotion:
+ *
+ * A page table that is completely filled with 4KB mappings for a single,
+ * superpage aligned block of physical memory, all with the same access
+ * rights, is replaced by a superpage entry in the page directory, marked
+ * with PERMS_PROMOTED.  Instead of being freed, the page table is kept in
+ * a pool (and is still charged to its space) so that a superpage can be
+ * demoted, if part of it is later unmapped or protected, without having
+ * to allocate memory.  The pool always holds one page for each promoted
+ * superpage.
+ *-----------------------------------------------------------------------*/
+static void* promotePool = 0;   // Page tables set aside for demotion
+
+static inline bool promoted(struct Pdir* pdir, unsigned i) {
+  return (*pdirSlot(pdir, i) & (PERMS_PROMOTED|1)) == (PERMS_PROMOTED|1);
+}
+
+/*-------------------------------------------------------------------------
+ * Replace the page table for the ith entry of the page directory of the
+ * given space with a superpage, if possible.  We test the last and first
+ * entries before scanning the rest because page tables are often filled
+ * in order.
+ */
+static void promote(struct Space* space, struct Pdir* pdir, unsigned i) {
+  struct Ptab* ptab = getPagetab(pdir, i);
+  Pte          pte  = ptab->pte[0];
+  Pte          ad   = 0;         // Accessed and dirty bits
+  if (!(ptab->pte[(1<<PTBITS)-1] & 1)
+   || !(pte & 1)
+   || mask((unsigned)pte, SUPERSIZE)>>PAGESIZE    // frame not aligned
+   || (space->small && i==0)                      // shared small space
+   || (space->kipArea>>SUPERSIZE == i)
+   || (space->utcbArea>>SUPERSIZE == i)) {
+    return;
+  }
+  for (unsigned j=0; j<(1<<PTBITS); j++) {
+    if ((ptab->pte[j] ^ pte) & ~(Pte)0x60) {
+      return;                    // different frame or access rights
+    }
+    ad  |= ptab->pte[j];
+    pte += (1<<PAGESIZE);
+  }
+  *pdirSlot(pdir, i) = (ptab->pte[0] & ~(Pte)0x60) | (ad & 0x60)
+                     | PERMS_SUPERPAGE | PERMS_PROMOTED;
+  *(void**)ptab      = promotePool;
+  promotePool        = ptab;
+  flushSpace(space);             // Remove 4KB entries from the TLB
+}
+
+/*-------------------------------------------------------------------------
+ * Split the promoted superpage at the ith entry of the page directory of
+ * the given space back into a page table, using a page from the pool.
+ */
+static struct Ptab* demote(struct Space* space, struct Pdir* pdir, unsigned i) {
+  Pte          pte  = *pdirSlot(pdir, i)
+                    & ~(Pte)(PERMS_SUPERPAGE|PERMS_PROMOTED);
+  struct Ptab* ptab = (struct Ptab*)promotePool;
+  promotePool       = *(void**)ptab;
+  for (unsigned j=0; j<(1<<PTBITS); j++) {
+    ptab->pte[j] = pte;
+    pte         += (1<<PAGESIZE);
+  }
+  *pdirSlot(pdir, i) = toPhys(ptab) | PERMS_USER_RW;
+  invalidate(space, i<<SUPERSIZE, SUPERSIZE);
+  return ptab;
+}
+
 /*-------------------------------------------------------------------------
  * Update a page directory by mapping a given Fpage of virtual addresses
- * at the specified physical address.  We assume that this mapping does
- * not overlap any existing mapping.
+ * at the specified physical page frame.  We assume that this mapping does
+ * not overlap any existing mapping, so no TLB flush is normally needed:
+ * the processor does not cache entries that are not present.  (The one
+ * exception is sigma0map(), which may replace a page whose access rights
+ * have been reduced by Unmap.)
  */
-static void mapFpage1(struct Space* space, Fpage vfp, unsigned phys) {
+static void mapFpage1(struct Reservation* r,
+                      struct Space* space, Fpage vfp, unsigned frame) {
   struct Pdir* pdir = fromPhys(struct Pdir*, space->pdir);
   unsigned     base = fpageStart(vfp);
   unsigned     size = fpageSize(vfp);
   unsigned     i    = base >> SUPERSIZE;
-  phys              = align(phys, size)
-                    | ((vfp & W) ? PERMS_USER_RW : PERMS_USER_RO);
-  if (size>=SUPERSIZE) {       // Allocate fpage using 4MB super pages
-    phys |= PERMS_SUPERPAGE;
+  Pte          pte  = fpagePte(vfp, frame);
+  Pte          old  = 0;   // Bitwise or of previous entries
+  if (space->small && (i!=0 || size>=SUPERSIZE)) {
+    makeLarge(space);      // Mapping does not fit in a small space
+  }
+  if (size>=SUPERSIZE) {       // Allocate fpage using super pages
+    pte |= PERMS_SUPERPAGE;
     for (unsigned j = i+(1<<(size-SUPERSIZE)); i<j; i++) {
-      pdir->pde[i] = phys;
-      phys        += (1<<SUPERSIZE);
+      old               |= *pdirSlot(pdir, i);
+      *pdirSlot(pdir, i) = pte;
+      pte               += (1<<SUPERSIZE);
     }
   } else if (size>=PAGESIZE) { // Allocate fpage using 4KB pages
     struct Ptab* ptab = getPagetab(pdir, i);
-    if (!ptab) {
-      ptab         = (struct Ptab*)allocPage1();
-      pdir->pde[i] = toPhys(ptab) | PERMS_USER_RW; // TODO: check this perm
+    if (ptab) {
+      ptab         = copyShared1(r, space, pdir, i);
+    } else {
+      if (promoted(pdir, i)) {
+        ptab       = demote(space, pdir, i);
+      } else {
+        ptab       = (struct Ptab*)allocSpacePage1(r, space);
+        *pdirSlot(pdir, i) = toPhys(ptab) | PERMS_USER_RW; // TODO: perm?
+      }
     }
-    i = mask(base>>PAGESIZE, 10);
-    for (unsigned j = i+(1<<(size-PAGESIZE)); i<j; i++) {
-      ptab->pte[i] = phys;
-      phys        += (1<<PAGESIZE);
+    unsigned k = mask(base>>PAGESIZE, PTBITS);
+    for (unsigned j = k+(1<<(size-PAGESIZE)); k<j; k++) {
+      old         |= ptab->pte[k];
+      ptab->pte[k] = pte;
+      pte         += (1<<PAGESIZE);
     }
   }
-  space->loaded = 0; // Force page directory register (cr3) reload
+  if (old & 1) {
+    invalidate(space, base, size);
+  }
+  if (size<SUPERSIZE) {
+    promote(space, pdir, i);
+  }
 }
 
 /*-------------------------------------------------------------------------
  * Update a page directory by unmapping a given Fpage of virtual addresses.
  * We assume that the same fpage was previously mapped using mapFpage.
  */
-static void unmapFpage(struct Space* space, Fpage vfp) {
-  struct Pdir* pdir = fromPhys(struct Pdir*, space->pdir);
-  unsigned     base = fpageStart(vfp);
-  unsigned     size = fpageSize(vfp);
-  unsigned     i    = base >> SUPERSIZE;
-  if (size>=SUPERSIZE) {        /* Fpage allocated using 4MB super pages */
-    for (unsigned j = i+(1<<(size-SUPERSIZE)); i<j; i++) {
-      pdir->pde[i] = 0;
+static void unmapFpage(struct Space* space, Fpage vfp) {
+  struct Pdir* pdir = fromPhys(struct Pdir*, space->pdir);
+  unsigned     base = fpageStart(vfp);
+  unsigned     size = fpageSize(vfp);
+  unsigned     i    = base >> SUPERSIZE;
+  if (size>=SUPERSIZE) {        /* Fpage allocated using super pages */
+    for (unsigned j = i+(1<<(size-SUPERSIZE)); i<j; i++) {
+      *pdirSlot(pdir, i) = 0;
+    }
+  } else if (size>=PAGESIZE) {  /* Fpage allocated fpage using 4KB pages */
+    struct Ptab* ptab = getPagetab(pdir, i);
+    if (!ptab && promoted(pdir, i)) {
+      ptab = demote(space, pdir, i);
+    }
+    if (ptab && !privateSlot(pdir, i)) {
+      dropShared(space, pdir, i);
+    } else if (ptab) {
+      if (findMapping(space, fpage(i<<SUPERSIZE, SUPERSIZE))
+         || (space->kipArea>>SUPERSIZE == i)
+	 || (space->utcbArea>>SUPERSIZE == i)) {
+        // There are other mappings within this superpage (either user
+	// mappings or kip/utcb mappings), so we just clear page table
+	// entries here and don't delete the storage...
+        i = mask(base>>PAGESIZE, PTBITS);
+        for (unsigned j = i+(1<<(size-PAGESIZE)); i<j; i++) {
+          ptab->pte[i] = 0;
+        }
+      } else {
+         // There are no remaining mappings within this superpage, so we
+         // can free up the storage that was used for the page table.
+         freeSpacePage(space, ptab);
+         *pdirSlot(pdir, i) = 0;
+      }
+    }
+  }
+  invalidate(space, base, size);
+}
+
+/*-------------------------------------------------------------------------
+ * Collect (and reset) the accessed and dirty bits in a single page table
+ * entry, returning them as R and W status bits, and remove any of the
+ * access rights in revoke: R removes the page altogether, W makes it read
+ * only, and X (only with PAE, if supported) makes it non-executable.
+ */
+static inline unsigned protectPte(Pte* pte, unsigned revoke) {
+  unsigned status = 0;
+  if (*pte & 1) {
+    status = ((*pte & 0x20) ? R : 0) | ((*pte & 0x40) ? W : 0);
+    *pte  &= ~(Pte)0x60;
+    if (revoke & R) {
+      *pte = 0;
+    } else if (revoke & W) {
+      *pte &= ~(Pte)0x2;
+    }
+#ifdef PAE
+    if ((revoke & X) && *pte) {
+      *pte |= nxbit;
+    }
+#endif
+  }
+  return status;
+}
+
+/*-------------------------------------------------------------------------
+ * Invalidate the TLB entry for a single (super)page whose entry has been
+ * changed by protectPte().  An entry whose accessed bit was clear cannot
+ * be in the TLB, so callers only need to do this when protectPte()
+ * returns a nonzero status.  The count limits the number of invlpgs that
+ * are used for a single range before we settle for a cr3 reload.
+ */
+static inline void invalidatePte(struct Space* space, unsigned addr,
+                                 unsigned size, unsigned* count) {
+  if (++*count > (1<<INVLPGBITS)) {
+    flushSpace(space);
+  } else {
+    invalidate(space, addr, size);
+  }
+}
+
+/*-------------------------------------------------------------------------
+ * Apply protectPte() to every page mapped at virtual addresses in the
+ * range [lo,hi] of the given space, except for the kip and utcb pages,
+ * returning the accumulated status bits.  Page tables are not freed,
+ * even if they become empty.
+ */
+static unsigned protectRange(struct Space* space,
+                             unsigned lo, unsigned hi, unsigned revoke) {
+  struct Pdir* pdir   = fromPhys(struct Pdir*, space->pdir);
+  unsigned     status = 0;
+  unsigned     count  = 0;  // Number of TLB entries invalidated so far
+  hi = min(hi, SMALLSPACES-1);
+  while (lo<=hi) {
+    unsigned     next = align(lo, SUPERSIZE) + (1<<SUPERSIZE);
+    unsigned     end  = min(hi, next-1);
+    struct Ptab* ptab = getPagetab(pdir, lo>>SUPERSIZE);
+    if (!ptab && promoted(pdir, lo>>SUPERSIZE)
+     && ((revoke & R) || lo!=align(lo, SUPERSIZE) || end!=next-1)) {
+      ptab = demote(space, pdir, lo>>SUPERSIZE);  // (partial change)
     }
-  } else if (size>=PAGESIZE) {  /* Fpage allocated fpage using 4KB pages */
-    struct Ptab* ptab = getPagetab(pdir, i);
-    if (ptab) {
-      if (findMapping(space, fpage(i<<SUPERSIZE, SUPERSIZE))
-         || (space->kipArea>>SUPERSIZE == i)
-	 || (space->utcbArea>>SUPERSIZE == i)) {
-        // There are other mappings within this superpage (either user
-	// mappings or kip/utcb mappings), so we just clear page table
-	// entries here and don't delete the storage...
-        i = mask(base>>PAGESIZE, 10);
-        for (unsigned j = i+(1<<(size-PAGESIZE)); i<j; i++) {
-          ptab->pte[i] = 0;
-        }
+    if (ptab && !privateSlot(pdir, lo>>SUPERSIZE)) {
+      if (revoke) {                 // Shared: drop it, or just read status
+        dropShared(space, pdir, lo>>SUPERSIZE);
       } else {
-         // There are no remaining mappings within this superpage, so we
-         // can free up the storage that was used for the page table.
-         freePage(ptab);
-         pdir->pde[i] = 0;
+        for (; lo<=end; lo+=(1<<PAGESIZE)) {
+          Pte pte = ptab->pte[mask(lo>>PAGESIZE, PTBITS)];
+          status |= ((pte & 0x20) ? R : 0) | ((pte & 0x40) ? W : 0);
+        }
+      }
+    } else if (ptab) {              // 4KB pages
+      for (; lo<=end; lo+=(1<<PAGESIZE)) {
+        if (((lo ^ space->kipArea)  & ~fpageMask(space->kipArea))
+         && ((lo ^ space->utcbArea) & ~fpageMask(space->utcbArea))) {
+          unsigned s = protectPte(ptab->pte+mask(lo>>PAGESIZE, PTBITS),
+                                  revoke);
+          if (s) {
+            status |= s;
+            invalidatePte(space, lo, PAGESIZE, &count);
+          }
+        }
+      }
+    } else {                        // Superpage, or nothing mapped
+      unsigned s = protectPte(pdirSlot(pdir, lo>>SUPERSIZE), revoke);
+      if (s) {
+        status |= s;
+        invalidatePte(space, lo, SUPERSIZE, &count);
       }
     }
+    lo = next;
   }
-  space->loaded = 0; // Force page directory register (cr3) reload
+  return status;
 }
 
 /*-------------------------------------------------------------------------
@@ -460,7 +1573,7 @@ static void unmapFpage(struct Space* space, Fpage vfp) {
 
 struct Space* sigma0Space;
 struct Space* rootSpace;
-static struct Space* currentSpace = 0;
+struct Space* kernelSpace;  // Shared by kernel threads; never has a pdir
 
 unsigned fpsize[64], fpmask[64]; // Size and mask arrays for fpages
 
@@ -471,8 +1584,14 @@ void initSpaces() {
   // Basic consistency checks:
   ASSERT(sizeof(struct Object)     == 32,   "Object size error");
   ASSERT(sizeof(struct ObjectPage) == (1<<PAGESIZE), "ObjectPage size error");
-  ASSERT(sizeof(struct Space)  <= sizeof(struct Object), "Space size error");
-  ASSERT(sizeof(struct Mapping)<= sizeof(struct Object), "Mapping size error");
+  ASSERT(sizeof(struct Space)      == 32,   "Space size error");
+  ASSERT(sizeof(struct ASIDPool) == (1<<PAGESIZE), "ASIDPool size error");
+#ifdef PAE
+  ASSERT(sizeof(struct Mapping)    == 28,   "Mapping size error");
+#else
+  ASSERT(sizeof(struct Mapping)    == 24,   "Mapping size error");
+#endif
+  ASSERT(sizeof(struct MappingPage) <= (1<<PAGESIZE), "MappingPage size error");
   ASSERT(mask((unsigned)Kip,PAGESIZE) == 0, "KIP alignment error");
   ASSERT((KipEnd-Kip) <= (1<<KIPAREASIZE),  "KIP size error");
   ASSERT(KIPAREASIZE <= PAGESIZE,           "KIP area size error");
@@ -492,18 +1611,78 @@ void initSpaces() {
   fpsize[1] = 32;
   fpmask[1] = ~0;
 
+  for (i=0; i<ASIDPOOLS; i++) {
+    asidPools[i] = 0;
+  }
+
   // Initialization:
-  abortIf(!availPages(5), "Unable to allocate initial address space");
-  utcbptr      = (unsigned*)allocPage1();
-  utcbPtab     = (struct Ptab*)allocPage1();
-  utcbPtab->pte[mask(UTCBPTR>>PAGESIZE, 10)]
+  struct Reservation r;
+  abortIf(!reservePages(&r, 6+NUMSMALL+TCBPTABS),
+          "Unable to allocate initial address space");
+  utcbptr      = (unsigned*)allocPage1(&r);
+  utcbPtab     = (struct Ptab*)allocPage1(&r);
+  utcbPtab->pte[mask(UTCBPTR>>PAGESIZE, PTBITS)]
                = toPhys(utcbptr) | PERMS_USER_RO;
-  sigma0Space  = allocSpace1();
-  rootSpace    = allocSpace1();
-  // Initialize mapping database:  TODO: this needs to be refined!
-  struct Mapping* m = addMapping1(sigma0Space, completeFpage()|R|W|X);
+  initPdir[UTCBPTR>>SUPERSIZE]
+               = toPhys(utcbPtab) | PERMS_USER_RW;
+  nullPage     = toPhys(allocPage1(&r));
+  for (i=0; i<TCBPTABS; i++) {  // Page tables for the TCB array
+    tcbPtabs[i] = (struct Ptab*)allocPage1(&r);
+    for (unsigned j=0; j<(1<<PTBITS); j++) {
+      tcbPtabs[i]->pte[j] = nullPage | PERMS_KERNEL_RO;
+    }
+    initPdir[(TCBSPACE>>SUPERSIZE)+i]
+                = toPhys(tcbPtabs[i]) | PERMS_KERNEL_RW;
+  }
+  for (i=0; i<NUMSMALL; i++) {  // Page tables for small space slots
+    slots[i].owner  = 0;
+    slots[i].saved  = 0;
+    slots[i].window = (struct Ptab*)allocPage1(&r);
+    initPdir[(SMALLSPACES>>SUPERSIZE)+i]
+                    = toPhys(slots[i].window) | PERMS_USER_RW;
+  }
+#ifdef PAE
+  // Enable execute disable (NX) bits, if the processor supports them:
+  unsigned eax, edx;
+  cpuid(0x80000000, &eax, &edx);
+  if (eax>=0x80000001) {
+    cpuid(0x80000001, &eax, &edx);
+    if (edx & (1<<20)) {                          // NX supported?
+      wrmsr(0xc0000080, rdmsr(0xc0000080) | (1<<11)); // set EFER.NXE
+      nxbit = 1ULL<<63;
+    }
+  }
+#endif
+  sigma0Space  = allocSpace1(&r);
+  rootSpace    = allocSpace1(&r);
+  kernelSpace  = allocSpace1(&r);
+  // Initialize mapping database:
+  struct Mapping* m = rootMapping = allocMapping1(&r, sigma0Space);
+  m->vfp   = completeFpage()|R|W|X;
+  m->phys  = 0;
   m->level = 1;
+  m->bal   = 0;
   m->next  = m->prev  = 0;
+  m->left  = m->right = 0;
+  releasePages(&r);
+}
+
+/*-------------------------------------------------------------------------
+ * Determine whether a given user address is mapped in the current page
+ * directory, so that the kernel can read it without triggering a fault.
+ */
+bool userMapped(unsigned addr) {
+  unsigned cr3;
+  asm("  movl  %%cr3, %0\n" : "=r"(cr3));
+  struct Pdir* pdir = fromPhys(struct Pdir*, align(cr3, 5));
+  Pte          pde  = *pdirSlot(pdir, addr>>SUPERSIZE);
+  if (addr>=KERNEL_SPACE || !(pde&1)) {
+    return 0;
+  } else if (pde&0x80) {                        // super page
+    return 1;
+  }
+  struct Ptab* ptab = getPagetab(pdir, addr>>SUPERSIZE);
+  return (ptab->pte[mask(addr>>PAGESIZE, PTBITS)]&1);
 }
 
 /*-------------------------------------------------------------------------
@@ -514,17 +1693,23 @@ bool privileged(struct Space* space) {
 }
 
 /*-------------------------------------------------------------------------
- * Allocate a new, (uninitialized) address space.
+ * Allocate a new, (uninitialized) address space.  The caller must check
+ * that there is a free ASID (availableASID()) before making a reservation.
  */
-struct Space* allocSpace1() {
-  struct Space* space = (struct Space*)allocObject1();
+struct Space* allocSpace1(struct Reservation* r) {
+  struct Space* space = allocASID1(r);
   space->pdir         = 0;
   space->mem          = 0;
   space->kipArea      = 0;
   space->utcbArea     = 0;
   space->count        = 0;
   space->active       = 0;
-  space->loaded       = 0;
+  space->small        = 0;
+  space->wantSmall    = 0;
+  space->dying        = 0;
+  space->nodes        = 0;
+  space->quota        = NOQUOTA;  // No limit until set by SpaceControl
+  space->used         = 0;
   return space;
 }
 
@@ -582,25 +1767,36 @@ bool validUtcb(struct Space* space, unsigned utcbAddr) {
  * We assume that the address space has been initialized with a valid
  * utcbArea area and that the specified utcb address has been validated.
  */
-void* allocUtcb4(struct Space* space, unsigned utcbAddr) {
+void* allocUtcb7(struct Reservation* r, struct Space* space, unsigned utcbAddr) {
   ASSERT(configuredSpace(space), "activating unconfigured space");
   ASSERT(validUtcb(space, utcbAddr), "activating with invalid address");
   struct Pdir* pdir;
+  if (space->dying) {
+    finishSpace(space);
+  }
   if (0==space->active++) {
-    pdir        = allocPdir2(fpageStart(space->kipArea));
+    pdir        = allocPdir5(r, space);
     space->pdir = toPhys(pdir);
+    changedSpace(space);
   } else {
     pdir        = fromPhys(struct Pdir*, space->pdir);
   }
-  space->loaded = 0;
-  return allocUtcbPage2(pdir, utcbAddr);
+  void* utcb = allocUtcbPage2(r, space, pdir, utcbAddr);
+  if (space->active==1 && space->wantSmall) {
+    makeSmall(space);
+  }
+  return utcb;
 }
 
 /*-------------------------------------------------------------------------
  * Indicate whether a given address space is active or not (i.e., whether
- * it contains active threads/a valid page directory).
+ * it contains active threads/a valid page directory).  A dying space is
+ * torn down first, so that it can be treated as inactive.
  */
 bool activeSpace(struct Space* space) {
+  if (space->dying) {
+    finishSpace(space);
+  }
   return (space->pdir!=0);
 }
 
@@ -609,9 +1805,9 @@ bool activeSpace(struct Space* space) {
  * to its page table structures.
  */
 void refreshSpace() {
-  if (!currentSpace->loaded) {   // Same thread, reload may be required
+  if (!loaded && currentSpace) { // Same thread, reload may be required
     setPdir(currentSpace->pdir);
-    currentSpace->loaded = 1;
+    loaded = 1;
   }
 }
 
@@ -619,59 +1815,570 @@ void refreshSpace() {
  * Switch to a specified address space.  This is a nop if we are already
  * running in the specified space (hence saving the overhead of reloading
  * the page directory register), but we can force a reload (for example,
- * if the page table structure has been changed) by setting the loaded
- * flag of the space to 0 prior to calling switchSpace().
+ * if the page table structure has been changed) by calling changedSpace()
+ * prior to calling switchSpace().
  */
 void switchSpace(struct Space* space) {
   if (space->pdir) {               // No switch for kernel/inactive threads
-    if (currentSpace!=space) {
+    if (space->small) {            // Small spaces are in every pdir, so we
+      if (!currentSpace) {         // only need to load one if there isn't
+        currentSpace = space;      // already one in cr3
+        loaded       = 0;
+      }
+      refreshSpace();
+    } else if (currentSpace!=space) {
       currentSpace = space;
       setPdir(currentSpace->pdir);
-      currentSpace->loaded = 1;
+      loaded       = 1;
     } else {
       refreshSpace();
     }
+    setSegments(space->small);
   }
 }
 
 /*-------------------------------------------------------------------------
- * Map a single page physical into sigma0's address space.
+ * Extend sigma0's idempotent mapping of physical memory to cover a given
+ * fault address.  If the whole superpage containing the address is free
+ * conventional memory and nothing is mapped there yet, then we map it in
+ * one step.  We mark the superpage as promoted and set aside a page table
+ * for it in promotePool, just as promote() would, so that it can still be
+ * demoted if some of its frames are later donated to the kernel.  In all
+ * other cases, we map a single page.
  */
-unsigned sigma0map(unsigned addr) {  // TODO: quick hack; refine?
-  if (availPages(1)) {
-    addr = align(addr, PAGESIZE);
-    mapFpage1(sigma0Space, fpage(addr, PAGESIZE)|R|W|X, addr);
+unsigned sigma0map(unsigned addr) {
+  struct Reservation r;
+  if (addr<SMALLSPACES && !kernelMemory(addr) && reservePages(&r, 1)) {
+    struct Pdir* pdir = fromPhys(struct Pdir*, sigma0Space->pdir);
+    unsigned     i    = addr>>SUPERSIZE;
+    unsigned     base = align(addr, SUPERSIZE);
+    if (!(*pdirSlot(pdir, i) & 1)
+        && !sigma0Space->small
+        && conventionalRange(base, base+((1<<SUPERSIZE)-1))) {
+      void* ptab    = allocSpacePage1(&r, sigma0Space);
+      *(void**)ptab = promotePool;
+      promotePool   = ptab;
+      *pdirSlot(pdir, i) = fpagePte(fpage(base, SUPERSIZE)|R|W|X,
+                                    base>>PAGESIZE)
+                         | PERMS_SUPERPAGE | PERMS_PROMOTED;
+    } else {
+      addr = align(addr, PAGESIZE);
+      mapFpage1(&r, sigma0Space, fpage(addr, PAGESIZE)|R|W|X,
+                addr>>PAGESIZE);
+    }
+    releasePages(&r);
     return 1;
   }
   return 0;
 }
 
+/*-------------------------------------------------------------------------
+ * Determine whether any virtual addresses in the range [lo,hi] are
+ * mapped in the given space.
+ */
+bool mappedRange(struct Space* space, unsigned lo, unsigned hi) {
+  return findRange(space, lo, hi)!=0;
+}
+
+/*-------------------------------------------------------------------------
+ * Respond to a page fault at a given virtual address in a space whose
+ * page table for the slot containing that address was dropped when it
+ * was shared with other spaces (see "Shared page tables").  The table is
+ * rebuilt from the space's memory map, and we return true if the faulting
+ * instruction should be retried.
+ */
+bool refillSpace(struct Space* space, unsigned addr) {
+  struct Reservation r;
+  struct Pdir*       pdir = fromPhys(struct Pdir*, space->pdir);
+  unsigned           i    = addr>>SUPERSIZE;
+  unsigned           lo   = i<<SUPERSIZE;
+  unsigned           hi   = lo + ((1<<SUPERSIZE)-1);
+  struct Mapping*    m;
+  if (addr>=SMALLSPACES
+   || space==sigma0Space
+   || (*pdirSlot(pdir, i) & 1)
+   || !findRange(space, lo, hi)
+   || !reserveSpace(&r, space, 1)) {
+    return 0;
+  }
+  struct Ptab* ptab  = (struct Ptab*)allocSpacePage1(&r, space);
+  *pdirSlot(pdir, i) = toPhys(ptab) | PERMS_USER_RW;
+  while ((m=findRange(space, lo, hi))) {
+    Pte      pte = fpagePte(m->vfp, m->phys);
+    unsigned k   = mask(fpageStart(m->vfp)>>PAGESIZE, PTBITS);
+    for (unsigned j = k+(1<<(fpageSize(m->vfp)-PAGESIZE)); k<j; k++) {
+      ptab->pte[k] = pte;
+      pte         += (1<<PAGESIZE);
+    }
+    if (fpageStart(m->vfp)<=lo) {
+      break;
+    }
+    hi = fpageStart(m->vfp)-1;
+  }
+  releasePages(&r);
+  return 1;
+}
+
+/*-------------------------------------------------------------------------
+ * Return the last node in the list for the subtree rooted at m.
+ */
+static struct Mapping* lastDescendant(struct Mapping* m) {
+  unsigned l = m->level;
+  while (m->next && m->next->level>l) {
+    m = m->next;
+  }
+  return m;
+}
+
 /*-------------------------------------------------------------------------
  * Flush a mapping, and all its descendants, from the mapping database.
+ * We work backwards from the last descendant, so that every node is a
+ * leaf when we remove it and the database is consistent at each step,
+ * which allows for a preemption point before every node.
  */
 static void flush(struct Mapping* m) {
-  struct Mapping* p = m->prev;
-  unsigned        l = m->level;
+  struct Mapping* n = lastDescendant(m);
+  for (;;) {
+    preemptionPoint();
+    struct Mapping* p = n->prev;
+DEBUG(printf("flush %x [prev=%x, next=%x, level=%d]\n", n, p, n->next, n->level);)
+    if ((p->next=n->next)) {
+      n->next->prev = p;
+    }
+    removeMapping(n);
+DEBUG(printf("unmapping %x from %x\n", n->vfp, mappingSpace(n));)
+    unmapFpage(mappingSpace(n), n->vfp);
+    freeMapping(n);
+    if (n==m) {
+      break;
+    }
+    n = p;
+  }
+}
+
+/*-------------------------------------------------------------------------
+ * Coalescing and splitting mappings:
+ *
+ * A pager that maps a large region one page at a time would otherwise
+ * leave a separate Mapping for every page, both in the mapping database
+ * and in the memory map of the receiving space.  Instead, each new
+ * mapping is merged with its "buddy" (the other half of the naturally
+ * aligned fpage of twice the size) if the two have the same parent and
+ * access rights and map the two halves of a naturally aligned block of
+ * physical memory.  Merging repeats for as long as it succeeds, stopping
+ * short of superpages, so the page tables never need to be changed.  If
+ * only part of a merged mapping is later replaced, or unmapped (whether
+ * by its own space or by an ancestor's revocation), then it is split
+ * (lazily, on demand) back into halves.
+ *-----------------------------------------------------------------------*/
+
+/*-------------------------------------------------------------------------
+ * Return the parent of a mapping in the mapping database.  This is linear
+ * in the number of younger siblings (and their descendants), but a buddy
+ * is almost always a recent sibling in practice.
+ */
+static struct Mapping* parentMapping(struct Mapping* m) {
+  unsigned l = m->level;
+  while ((m=m->prev)->level>=l) {
+  }
+  return m;
+}
+
+/*-------------------------------------------------------------------------
+ * Merge a mapping m, whose parent is p, with its buddy for as long as
+ * possible, returning the (possibly enlarged) mapping m.
+ */
+static struct Mapping* coalesce(struct Mapping* m, struct Mapping* p) {
+  struct Space* space = mappingSpace(m);
+  unsigned      size;
+  while ((size=fpageSize(m->vfp))+1<SUPERSIZE) {
+    unsigned        lo   = fpageStart(m->vfp);
+    unsigned        blo  = lo ^ (1<<size);
+    unsigned        base = min(lo, blo);
+    unsigned        phys = m->phys - ((lo-base)>>PAGESIZE);
+    struct Mapping* b    = findRange(space, blo, blo+(1<<size)-1);
+    if (!b
+     || fpageStart(b->vfp)!=blo
+     || fpageSize(b->vfp)!=size
+     || ((b->vfp ^ m->vfp) & (R|W|X))
+     || b->phys!=phys+((blo-base)>>PAGESIZE)
+     || mask(phys, size+1-PAGESIZE)
+     || (space!=sigma0Space && parentMapping(b)!=p)) {
+      break;
+    }
+    // Move the descendants of b into the subtree for m, and then remove b:
+    struct Mapping* e = lastDescendant(b);
+    if ((b->prev->next=e->next)) {
+      e->next->prev = b->prev;
+    }
+    if (e!=b) {
+      struct Mapping* c = b->next;
+      if ((e->next=m->next)) {
+        e->next->prev = e;
+      }
+      m->next = c;
+      c->prev = m;
+    }
+    m->vfp |= b->vfp & STALE;
+    removeMapping(b);
+    freeMapping(b);
+    m->vfp  = fpage(base, size+1) | (m->vfp & (R|W|X|STALE));
+    m->phys = phys;
+  }
+  return m;
+}
+
+/*-------------------------------------------------------------------------
+ * Determine whether a mapping can be split in half: its page table
+ * entries must not be superpages, and none of its children may be as
+ * big as m (a child that is smaller than m maps frames in only one half).
+ */
+static bool splittable(struct Mapping* m) {
+  unsigned size = fpageSize(m->vfp);
+  if (size>=SUPERSIZE) {
+    return 0;
+  }
+  for (struct Mapping* c=m->next; c && c->level>m->level; c=c->next) {
+    if (c->level==m->level+1 && fpageSize(c->vfp)==size) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*-------------------------------------------------------------------------
+ * Split a mapping m into smaller pieces until it is no bigger than the
+ * fpage fp that it contains (or cannot be split any further), returning
+ * the piece that contains fp.  Each step uses one new Mapping for the
+ * half of m that does not contain fp, which becomes a sibling of m and
+ * takes the children of m that map frames in that half.
+ */
+static struct Mapping* splitMapping1(struct Reservation* r,
+                                     struct Mapping* m, Fpage fp) {
+  while (fpageSize(m->vfp)>fpageSize(fp) && splittable(m)) {
+    unsigned size  = fpageSize(m->vfp)-1;
+    unsigned perms = m->vfp & (R|W|X|STALE);   // (both halves keep STALE)
+    unsigned lo    = fpageStart(m->vfp);
+    unsigned mid   = lo + (1<<size);
+    unsigned phys  = m->phys;
+    unsigned half  = 1<<(size-PAGESIZE);
+    unsigned nlo;
+    if (fpageStart(fp)>=mid) {  // m keeps the upper half (changing the key
+      m->vfp  = fpage(mid, size) | perms;   // for m in the memory map
+      m->phys = phys + half;    // before the lower half is added to it)
+      nlo     = lo;
+    } else {
+      m->vfp  = fpage(lo, size) | perms;
+      phys   += half;
+      nlo     = mid;
+    }
+    struct Mapping* n = addMapping1(r, mappingSpace(m), fpage(nlo, size) | perms);
+    n->phys  = phys;
+    n->level = m->level;
+
+    // Divide the subtrees of the children of m between m and n:
+    struct Mapping* p = m;     // last node in the list for m so far
+    struct Mapping* q = n;     // last node in the list for n so far
+    struct Mapping* c = m->next;
+    while (c && c->level>m->level) {
+      struct Mapping* e    = lastDescendant(c);
+      struct Mapping* next = e->next;
+      if (phys<=c->phys && c->phys<phys+half) {
+        q->next = c;
+        c->prev = q;
+        q       = e;
+      } else {
+        p->next = c;
+        c->prev = p;
+        p       = e;
+      }
+      c = next;
+    }
+    p->next = n;
+    n->prev = p;
+    if ((q->next=c)) {
+      c->prev = q;
+    }
+  }
+  return m;
+}
+
+/*-------------------------------------------------------------------------
+ * Reserve the memory (if any) that is needed to allocate one more Mapping
+ * for the given space.
+ */
+static bool reserveMapping(struct Reservation* r, struct Space* space) {
+  if (space->nodes) {           // a partly filled page has room
+    r->pages = 0;
+    return 1;
+  }
+  return reserveSpace(r, space, 1);
+}
+
+/*-------------------------------------------------------------------------
+ * Split a mapping n that is smaller than a superpage in half, with n
+ * keeping the lower half.  Any descendants of n that are the same size
+ * map exactly the same frames, and must be split first; the last of them
+ * in the list has no children of the same size, so we work back up from
+ * there, one split (and one Mapping) at a time.  Returns false, leaving
+ * n intact, if a split would take one of the spaces over its quota or
+ * there is no free memory (some descendants may then have been split
+ * already, which is harmless).
+ */
+static bool splitHalf(struct Mapping* n) {
+  unsigned        size = fpageSize(n->vfp);
+  struct Mapping* x;
   do {
-    struct Mapping* next = m->next;
-DEBUG(printf("flush %x [prev=%x, next=%x, level=%d]\n", m, p, next, m->level);)
-    removeMapping(m);
-DEBUG(printf("unmapping %x from %x\n", m->vfp, m->space);)
-    unmapFpage(m->space, m->vfp);
-DEBUG(printf("freeing %x\n", m);)
-    freeObject((struct Object*)m);
-    m = next;
-DEBUG(printf("moving on to next (%x)...\n", m);)
-  } while (m && (m->level > l));
-DEBUG(printf("loop finishes at p=%x, m=%x\n", p, m);)
-  if (p) p->next = m; // test for null p is unlikely to be necessary
-  if (m) m->prev = p;
+    x = n;
+    for (struct Mapping* c=n->next; c && c->level>n->level; c=c->next) {
+      if (fpageSize(c->vfp)==size) {
+        x = c;
+      }
+    }
+    struct Reservation r;
+    if (!reserveMapping(&r, mappingSpace(x))) {
+      return 0;
+    }
+    splitMapping1(&r, x, fpage(fpageStart(x->vfp), size-1));
+    releasePages(&r);
+  } while (x!=n);
+  return 1;
+}
+
+/*-------------------------------------------------------------------------
+ * Frame nodes:
+ *-----------------------------------------------------------------------*/
+static inline bool hasChildren(struct Mapping* m) {
+  return m->next && m->next->level > m->level;
+}
+
+/*-------------------------------------------------------------------------
+ * Remove a frame node that has no children.  This does not change any of
+ * sigma0's own page table entries.
+ */
+static void removeFrameNode(struct Mapping* m) {
+  if ((m->prev->next=m->next)) {
+    m->next->prev = m->prev;
+  }
+  removeMapping(m);
+  freeMapping(m);
+}
+
+/*-------------------------------------------------------------------------
+ * Find the frame node that covers a given fpage in sigma0's space, adding
+ * a new one if there are no frame nodes in the fpage, or if the only
+ * ones there have no children (in which case they are replaced).  If the
+ * fpage overlaps smaller frame nodes that are in use, then one of those
+ * is returned instead and the caller must check its size.
+ */
+static struct Mapping* frameNode1(struct Reservation* r, Fpage fp) {
+  unsigned        lo = fpageStart(fp);
+  unsigned        hi = fpageEnd(fp);
+  struct Mapping* m;
+  while ((m=findRange(sigma0Space, lo, hi))) {
+    if ((fpageStart(m->vfp)<=lo && hi<=fpageEnd(m->vfp)) || hasChildren(m)) {
+      return m;
+    }
+    removeFrameNode(m);
+  }
+  m        = addMapping1(r, sigma0Space, fp|R|W|X);
+  m->phys  = lo>>PAGESIZE;
+  m->level = rootMapping->level + 1;
+  m->prev  = rootMapping;
+  if ((m->next=rootMapping->next)) {
+    m->next->prev = m;
+  }
+  rootMapping->next = m;
+  return coalesce(m, rootMapping);
+}
+
+/*-------------------------------------------------------------------------
+ * Find the mapping that covers (or, failing that, is contained in) the
+ * given fpage in the sending space for a map operation.  Sigma0 can send
+ * any fpage, except one that includes pages in use as kernel memory.
+ */
+static inline struct Mapping* sendMapping1(struct Reservation* r,
+                                           struct Space* space, Fpage fp) {
+  if (space==sigma0Space) {
+    return kernelMemoryIn(fpageStart(fp), fpageEnd(fp)) ? 0
+                                                        : frameNode1(r, fp);
+  }
+  return findMapping(space, fp);
+}
+
+/*-------------------------------------------------------------------------
+ * Return the status bits for a mapping that was marked STALE when a
+ * shared page table was dropped (see "Shared page tables"), assuming the
+ * worst, and clear the mark once the range [lo,hi] covers the mapping.
+ * This must be called after the page tables for m have been protected,
+ * which may drop a shared table and so mark m as STALE.
+ */
+static unsigned staleStatus(struct Mapping* m, unsigned lo, unsigned hi) {
+  if (!(m->vfp & STALE)) {
+    return 0;
+  }
+  if (lo<=fpageStart(m->vfp) && fpageEnd(m->vfp)<=hi) {
+    m->vfp &= ~STALE;
+  }
+  return R | (m->vfp & W);
+}
+
+/*-------------------------------------------------------------------------
+ * Revoke the access rights in perms from every descendant of mapping m
+ * that maps any of the page frames in [f0,f1], adding the accessed and
+ * dirty status bits for those descendants to *status.  Rights are
+ * recorded for each Mapping as a whole, so a descendant that only partly
+ * overlaps the frames (perhaps because it was coalesced from several
+ * mappings) is split in half, and the halves are considered again, until
+ * only the pages in [f0,f1] are affected.  If a split is not possible,
+ * because the descendant is a superpage or its space has run out of
+ * memory, then the whole descendant is revoked instead; a pager must
+ * always be able to revoke what it has mapped.  Revoking R removes the
+ * descendant (and, hence, all of its descendants) altogether; status bits
+ * are collected before the flush, so they are not lost if it is preempted.
+ */
+static void revokeDescendants(struct Mapping* m, unsigned f0, unsigned f1,
+                              unsigned perms, unsigned* status) {
+  unsigned        l = m->level;
+  struct Mapping* p = m;
+  struct Mapping* n;
+  while ((n=p->next) && n->level>l) {
+    unsigned size = fpageSize(n->vfp);
+    unsigned last = n->phys + (1<<(size-PAGESIZE)) - 1;
+    if (n->phys<=f1 && f0<=last) {
+      if ((n->phys<f0 || f1<last) && size<SUPERSIZE && splitHalf(n)) {
+        continue;                   // consider the lower half of n again
+      }
+      if (perms & R) {
+        struct Mapping* d = n;      // collect status before flushing n
+        do {
+          *status |= protectRange(mappingSpace(d),
+                                  fpageStart(d->vfp), fpageEnd(d->vfp), 0);
+          *status |= staleStatus(d, 0, ~0);
+        } while ((d=d->next) && d->level>n->level);
+        flush(n);                   // sets p->next to n's successor
+        continue;
+      }
+      *status |= protectRange(mappingSpace(n),
+                              fpageStart(n->vfp), fpageEnd(n->vfp), perms);
+      *status |= staleStatus(n, 0, ~0);
+      n->vfp &= ~perms;
+    }
+    p = n;
+  }
+}
+
+/*-------------------------------------------------------------------------
+ * Unmap an fpage from the given space, as described by the L4 Unmap
+ * system call: the access rights in the fpage are revoked from every
+ * mapping derived from the pages in that fpage and, if own is set, from
+ * the mappings in the space itself.  The accessed and written status of
+ * the pages in the fpage since the last Unmap is added to *status, using
+ * the R and W bits.  Changes to the page tables of the current space are
+ * not visible until the next refreshSpace(), which allows a batch of
+ * fpages to be unmapped with a single TLB flush.  If own is set, then a
+ * mapping in the space that is bigger than the fpage (other than a
+ * superpage) is split so that only the part inside the fpage is
+ * affected.  The result is false, with nothing changed in the space
+ * itself, if that split would take the space over its quota (or there is
+ * no free memory).  The status bits are accumulated in *status as they
+ * are collected, so that a caller that is preempted part way through can
+ * keep the bits from the mappings that have already been removed, and
+ * pass them back in when the operation is restarted.
+ */
+bool revokeFpage(struct Space* space, Fpage fp, bool own, unsigned* status) {
+  unsigned perms = fp & (R|W|X);
+  if (!isNilpage(fp) && activeSpace(space)) {
+    unsigned        lo = fpageStart(fp);
+    unsigned        hi = fpageEnd(fp);
+    struct Mapping* m;
+    if (space==sigma0Space) {   // sigma0's own mappings are never removed
+      *status |= protectRange(space, lo, hi, own ? perms : 0);
+    }
+    while ((m=findRange(space, lo, hi))) {
+      if (own && space!=sigma0Space) {  // fp may lie inside m:
+        while (fpageSize(m->vfp)<SUPERSIZE
+               && (fpageStart(m->vfp)<lo || hi<fpageEnd(m->vfp))) {
+          if (!splitHalf(m)) {
+            return 0;
+          }
+          m = findRange(space, lo, hi);
+        }
+      }
+      unsigned mlo = fpageStart(m->vfp);
+      unsigned mhi = fpageEnd(m->vfp);
+      unsigned rlo = max(lo, mlo);
+      unsigned rhi = min(hi, mhi);
+      revokeDescendants(m,
+                        m->phys + ((rlo-mlo)>>PAGESIZE),
+                        m->phys + ((rhi-mlo)>>PAGESIZE),
+                        perms, status);
+      if (space==sigma0Space) {
+        // Frame node: sigma0's page tables have already been updated
+      } else if (!own) {
+        *status |= protectRange(space, rlo, rhi, 0);
+        *status |= staleStatus(m, rlo, rhi);
+      } else {
+        *status |= protectRange(space, mlo, mhi, perms & ~R);
+        *status |= staleStatus(m, mlo, mhi);
+        if ((m->vfp & ~perms & (R|W|X))==0 || (perms & R)) {
+          flush(m);
+        } else {
+          m->vfp &= ~perms;
+        }
+      }
+      if (mlo<=lo) {
+        break;
+      }
+      hi = mlo-1;
+    }
+  }
+  return 1;
+}
+
+/*-------------------------------------------------------------------------
+ * Remove every user space mapping of a given page frame: flush any nodes
+ * in the mapping database below the frame node for the frame, and then
+ * remove sigma0's own (idempotent) mapping.
+ */
+static void revokeFrame(unsigned frame) {
+  Fpage           fp = fpage(frame<<PAGESIZE, PAGESIZE);
+  struct Mapping* m  = findMapping(sigma0Space, fp);
+  if (m) {
+    unsigned status = 0;
+    revokeDescendants(m, frame, frame, R, &status);
+    if (!hasChildren(m)) {
+      removeFrameNode(m);
+    }
+  }
+  unmapFpage(sigma0Space, fp);
+}
+
+/*-------------------------------------------------------------------------
+ * Donate the page frames in a given fpage of sigma0's (idempotently
+ * mapped) address space to the kernel, returning the number of pages that
+ * were added to the kernel's free list.  Frames that cannot be used as
+ * kernel memory are skipped.
+ */
+unsigned donateFpage(Fpage fp) {
+  unsigned count = 0;
+  unsigned phys  = fpageStart(fp);
+  unsigned end   = min(fpageEnd(fp), physTop-1);
+  for (; phys<end; phys+=(1<<PAGESIZE)) {
+    if (donatable(phys)) {
+      revokeFrame(phys>>PAGESIZE);
+      donatePage(phys);
+      count++;
+    }
+  }
+  return count;
 }
 
 /*-------------------------------------------------------------------------
  * Create a mapping between address spaces.
  */
-void map2(struct Space* sendspace, Fpage sendfp, unsigned sendbase,
+void map2(struct Reservation* r,
+          struct Space* sendspace, Fpage sendfp, unsigned sendbase,
           struct Space* recvspace, Fpage recvfp) {
 DEBUG(printf("mapping %x,%x in space %x to %x in %x\n", sendfp, sendbase, sendspace, recvfp, recvspace);)
   // A map with the same send and recv space is a NOP:
@@ -697,9 +2404,20 @@ DEBUG(printf("nil page, no map\n");)
   }
 DEBUG(printf("adjusted mapping: %x,%x in space %x to %x in %x\n", sendfp, sendbase, sendspace, recvfp, recvspace);)
 
-  // Check that send page is mapped in send space:
-  struct Mapping* s = findMapping(sendspace, sendfp);
-  if (s==0 || (sendsize=fpageSize(s->vfp))<recvsize) {
+  // Check that send page is mapped in send space.  If the sender only
+  // has smaller mappings in the send fpage, then we map the one that
+  // contains the send base address, if any (for example, to allow a
+  // pager to respond to a fault with a larger fpage than it holds).
+  struct Mapping* s = sendMapping1(r, sendspace, sendfp);
+  if (s && (sendsize=fpageSize(s->vfp))<recvsize) {
+    unsigned addr = fpageStart(sendfp) | (sendbase & fpageMask(sendfp));
+    if ((s=sendMapping1(r, sendspace, fpage(addr, PAGESIZE)))) {
+      sendfp   = trimFpage(sendfp, sendbase, s->vfp);
+      recvfp   = trimFpage(recvfp, sendbase, s->vfp);
+      sendsize = recvsize = fpageSize(s->vfp);
+    }
+  }
+  if (s==0) {
 DEBUG(printf("send page is not mapped in send space\n");)
     return;
   }
@@ -708,7 +2426,7 @@ DEBUG(printf("send page is not mapped in send space\n");)
 
   // Calculate permissions for receiving fpage:
   unsigned perms = (R|W|X) & sendfp & (s->vfp);
-  if (perms==0) {
+  if (perms==0 || s->level==MAXLEVEL) {
     return;
   }
   recvfp = (recvfp & ~(R|W|X)) | perms;
@@ -717,7 +2435,7 @@ DEBUG(printf("receive fpage is %x\n");)
   // Check that recv page doesn't intersect kernel, kip, or utcb area
   unsigned recvstart = fpageStart(recvfp);
   unsigned recvend   = fpageEnd(recvfp);
-  if (recvend>=KERNEL_SPACE
+  if (recvend>=SMALLSPACES
      || (recvstart<=fpageStart(recvspace->utcbArea) &&
          recvend>=fpageEnd(recvspace->utcbArea))
      || (recvstart<=fpageStart(recvspace->kipArea) &&
@@ -733,13 +2451,18 @@ DEBUG(printf("clearing already mapped pages in recv space\n");)
     // We can't flush t until we're commited to doing this map; so there
     // better not be any more checks after this ...
     unsigned tsize = fpageSize(t->vfp);
+    if (tsize>recvsize) {     // Keep the parts of t outside recvfp
+      t     = splitMapping1(r, t, recvfp);
+      tsize = fpageSize(t->vfp);
+    }
 DEBUG(printf("tsize=%d, recvsize=%d, sendsize=%d\n", tsize, recvsize, sendsize);)
     if (tsize<recvsize) {
       // t is too small to cover recvfp, so (1) there might be other
       // fpages mapped in recvfp, which means that we need a loop to
       // make sure we find them all; and (2) neither t nor any of the
       // other nodes that we might find in this range are big enough
-      // to have s as a descendant.
+      // to have s as a descendant.  If this is preempted, then the IPC
+      // is restarted, and the nodes that were flushed stay flushed.
       do {
         flush(t);
       } while ((t=findMapping(recvspace, recvfp)));
@@ -757,7 +2480,7 @@ DEBUG(printf("case 2\n");)
         unsigned        l = t->level;
         struct Mapping* n = t->next;
 DEBUG(printf("test holds, level l=%d\n", l);)
-        for (; n->level<l; n=n->next) {
+        for (; n && n->level>l; n=n->next) {
 DEBUG(printf("n->level=%d\n", n->level);)
           if (n==s) {
 DEBUG(printf("***** IGNORING MAPPING \n");)
@@ -780,18 +2503,208 @@ DEBUG(printf("all checks cleared, proceeding with mapping\n");)
 
   // We've validated all parameters and cleared out any memory mapped
   // into the recv fpage.  No more excuses; time to add the mapping!
-  t        = addMapping1(recvspace, recvfp);
+  t        = addMapping1(r, recvspace, recvfp);
   t->level = 1 + s->level;
   t->prev  = s;
   if ((t->next=s->next)) {
     t->next->prev = t;
   }
   s->next  = t;
-  mapFpage1(recvspace, recvfp,
-            t->phys = (s->phys) + fpageStart(sendfp) - fpageStart(s->vfp));
+  mapFpage1(r, recvspace, recvfp,
+            t->phys = (s->phys)
+                    + ((fpageStart(sendfp) - fpageStart(s->vfp))>>PAGESIZE));
+  sharePtab(coalesce(t, s), s);
 DEBUG(printf("mapping completed\n");)
 }
 
+/*-------------------------------------------------------------------------
+ * Clone the mappings of the src space that lie within the fpage fp into
+ * the dest space, at the same addresses, with their access rights limited
+ * to those in fp (so that a pager can, for example, clone a template read
+ * only as the first step of a copy on write fork).  Each new mapping is a
+ * child of the mapping that it was cloned from, just as if src had mapped
+ * it to dest, and each page table that ends up the same as the table for
+ * the same slot in src, or in another clone, is shared.  Mappings that
+ * only partly overlap fp, or that overlap existing mappings or the kip or
+ * utcb areas of dest, are skipped, which also makes it safe to repeat a
+ * clone that was preempted part way through.  Every slot that holds
+ * mappings of src is joined with the table in src as we leave it, even if
+ * this pass made no clones there, so that slots that were filled before a
+ * restart are still shared.  Returns false if dest runs out of memory, in
+ * which case only part of fp will have been cloned.
+ */
+bool cloneSpace(struct Space* dest, struct Space* src, Fpage fp) {
+  unsigned        perms = fp & (R|W|X);
+  unsigned        lo    = fpageStart(fp);
+  unsigned        end   = min(fpageEnd(fp), SMALLSPACES-1);
+  unsigned        hi    = end;
+  unsigned        slot  = ~0;   // Slot of the last mapping in src
+  struct Mapping* last  = 0;    // Last clone in that slot, if any
+  struct Mapping* m;
+  if (isNilpage(fp)) {
+    return 1;
+  }
+  while ((m=findRange(src, lo, hi))) {
+    unsigned mlo = fpageStart(m->vfp);
+    unsigned mhi = fpageEnd(m->vfp);
+    if ((mlo>>SUPERSIZE)!=slot) {       // Share the table for each slot
+      if (slot!=~0 && !joinPtab(dest, src, slot) && last) { // as we
+        sharePtab(last, parentMapping(last));                // leave it
+      }
+      slot = mlo>>SUPERSIZE;
+      last = 0;
+    }
+    if ((m->vfp & perms)
+     && m->level<MAXLEVEL
+     && lo<=mlo && mhi<=end
+     && !findRange(dest, mlo, mhi)
+     && (mhi<fpageStart(dest->kipArea)  || fpageEnd(dest->kipArea)<mlo)
+     && (mhi<fpageStart(dest->utcbArea) || fpageEnd(dest->utcbArea)<mlo)) {
+      struct Reservation r;
+      if (!reserveSpace(&r, dest, 2)) { // a Mapping page and a page table
+        return 0;
+      }
+      struct Mapping* t = addMapping1(&r, dest,
+                                      fpage(mlo, fpageSize(m->vfp))
+                                      | (m->vfp & perms));
+      t->level = 1 + m->level;
+      t->prev  = m;
+      if ((t->next=m->next)) {
+        t->next->prev = t;
+      }
+      m->next  = t;
+      mapFpage1(&r, dest, t->vfp, t->phys = m->phys);
+      releasePages(&r);
+      last     = t;
+      preemptionPoint();
+    }
+    if (mlo<=lo) {
+      break;
+    }
+    hi = mlo-1;
+  }
+  if (slot!=~0 && !joinPtab(dest, src, slot) && last) {
+    sharePtab(last, parentMapping(last));
+  }
+  return 1;
+}
+
+/*-------------------------------------------------------------------------
+ * Deferred address space teardown:
+ *
+ * When the last active thread in a space is deleted, we do not dismantle
+ * the space immediately, which could leave interrupts disabled for a long
+ * time if the space has many mappings.  Instead, the space is marked as
+ * dying (so that it cannot be used again without first being torn down)
+ * and added to a queue.  The idle thread flushes the mappings of queued
+ * spaces a slice at a time, with interrupts enabled between slices, and
+ * then frees the page directory, as well as the Space itself if it no
+ * longer has any threads.  (A slice is also cut short at a preemption
+ * point if an interrupt arrives while a large subtree is being flushed.)
+ * Pending work for a space is completed at once if the space is
+ * reactivated or reconfigured, if the queue is full, or if there are not
+ * enough free pages for the system call that is being made.  The
+ * ThreadControl and SpaceControl system calls use settleSpace() to do
+ * that work on entry, before they make any changes, so that it can be
+ * preempted and restarted.  A reservation that cannot be satisfied while
+ * dying spaces still hold memory at any other point simply fails.
+ *-----------------------------------------------------------------------*/
+#define NUMDYING     32         // Maximum number of spaces in the queue
+#define RECLAIMSLICE 64         // Number of mappings flushed in each slice
+
+static struct Space* dying[NUMDYING];   // Queue of dying spaces
+static unsigned      numDying = 0;      // Number of spaces in the queue
+
+/*-------------------------------------------------------------------------
+ * Flush mappings from a dying space, decrementing the budget for each
+ * one, and return true if the teardown was completed before the budget
+ * ran out.  The caller is responsible for removing the space from the
+ * queue, which must not be referenced again if the teardown completes.
+ */
+static bool teardown(struct Space* space, unsigned* budget) {
+  for (struct Mapping* m; (m=space->mem); --*budget) {
+    if (*budget==0) {
+      return 0;
+    }
+    flush(m);
+  }
+  freePdir(space);
+  space->dying = 0;
+  if (space->count==0 && !privileged(space)) {
+DEBUG(printf("teardown: free space object\n");)
+    freeASID(space);
+  }
+  return 1;
+}
+
+/*-------------------------------------------------------------------------
+ * Complete the teardown of a specific dying space.  The space stays in
+ * the queue until the teardown is finished, in case it is preempted.
+ */
+static void finishSpace(struct Space* space) {
+  unsigned budget = ~0;
+  unsigned i      = 0;
+  while (i<numDying && dying[i]!=space) {
+    i++;
+  }
+  teardown(space, &budget);
+  if (i<numDying) {
+    dying[i] = dying[--numDying];
+  }
+}
+
+/*-------------------------------------------------------------------------
+ * Complete the teardown of one of the dying spaces, if there are any,
+ * returning true if there was one.
+ */
+static bool finishDying() {
+  if (numDying==0) {
+    return 0;
+  }
+  finishSpace(dying[0]);
+  return 1;
+}
+
+/*-------------------------------------------------------------------------
+ * Complete any teardown that a system call working on the given space
+ * (which may be null) might otherwise have to do part way through: of the
+ * space itself, if it is dying, of the oldest dying space, if the queue
+ * is full, and of as many dying spaces as it takes to free the n pages
+ * that the system call may need.  This is called before the system call
+ * makes any changes, so the teardown can be preempted, and the system
+ * call restarted, without harm.
+ */
+void settleSpace(struct Space* space, unsigned n) {
+  struct Reservation r;
+  allowRestart(1);
+  if (space && space->dying) {
+    finishSpace(space);
+  }
+  if (numDying==NUMDYING) {
+    finishDying();
+  }
+  while (!reservePages(&r, n) && finishDying()) {
+    // Keep going until there are enough free pages
+  }
+  releasePages(&r);
+  allowRestart(0);
+}
+
+/*-------------------------------------------------------------------------
+ * Perform a single, bounded slice of deferred teardown, returning true
+ * if there is more work still to be done.
+ */
+bool reclaimSpaces() {
+  unsigned budget = RECLAIMSLICE;
+  while (numDying>0) {
+    if (!teardown(dying[0], &budget)) {
+      return 1;
+    }
+    dying[0] = dying[--numDying];
+  }
+  return 0;
+}
+
 /*-------------------------------------------------------------------------
  * Signal that a thread is being removed from an address space.  We assume
  * that there is a corresponding earlier matching enterSpace() call for
@@ -805,37 +2718,30 @@ DEBUG(printf("exitSpace %x, active=%d\n", space, space->active);)
 DEBUG(printf("BEFORE:\n");)
 DEBUG(showSpace(space);)
 DEBUG(showMappingDB();)
-  // If this was the last active thread in the address space, then we
-  // reclaim any mapping and page directory storage space that was in use.
+  // If this was the last active thread in the address space, then the
+  // mapping and page directory storage space that was in use will be
+  // reclaimed by a deferred teardown.
   if (utcb && --space->active==0) {  // Last active thread in space?
-    // Flush all of the memory mapping nodes for this space:
-    // TODO: this could probably be done better if we avoided flush()
-DEBUG(printf("exitSpace: flushing space\n");)
-    for (struct Mapping* m; (m=space->mem); ) {
-DEBUG(printf("--------------------------\ntree: %x\n", m);)
-DEBUG(showMapping(2, m);)
-      for (struct Mapping* l; (l=m->left)!=0; m=l) {
-        m->left  = l->right;                 // rotate to avoid recursion
-        l->right = m;
-DEBUG(printf("after rotation:\n");)
-DEBUG(showMapping(4, l);)
-      }
-      flush(space->mem = m);
+DEBUG(printf("exitSpace: queueing space for teardown\n");)
+    if (space->small) {
+      makeLarge(space);
     }
-    // Free the page directory for this space:
-DEBUG(printf("exitSpace: free page directory\n");)
-    freePdir(fromPhys(struct Pdir*, space->pdir), space->utcbArea);
+    if (numDying==NUMDYING) {        // Make room in the queue
+      finishDying();
+    }
+    space->dying       = 1;
+    dying[numDying++]  = space;
   }
 
   // If this was the last thread in the address space, then we can also
   // reclaim storage for the complete space structure.  An exception is
   // made for privileged spaces, which are never deleted, even if they
   // become empty.  This ensures that no other space can be allocated
-  // later at the same address and accidentally obtain privileges that
-  // it was not intended to have ...
-  if (--space->count==0 && !privileged(space)) {
+  // later at the same address (and with the same ASID) and accidentally
+  // obtain privileges that it was not intended to have ...
+  if (--space->count==0 && !privileged(space) && !space->dying) {
 DEBUG(printf("exitSpace: free space object\n");)
-    freeObject((struct Object*)space);
+    freeASID(space);
   }
 DEBUG(else { printf("AFTER:\n"); showSpace(space); })
 DEBUG(showMappingDB();)
@@ -846,26 +2752,27 @@ DEBUG(showMappingDB();)
  */
 void showPdir(struct Pdir* pdir) { // TODO: Remove me; debugging code
   printf("  Page directory at %x\n", pdir);
-  for (unsigned i=0; i<1024; i++) {
-    if (pdir->pde[i]&1) {
-      if (pdir->pde[i]&0x80) {
+  for (unsigned i=0; i<PDENTRIES; i++) {
+    unsigned pde = (unsigned)*pdirSlot(pdir, i);
+    if (pde&1) {
+      if (pde&0x80) {
         printf("    %x: [%x-%x] => [%x-%x], superpage\n",
                i, (i<<SUPERSIZE), ((i+1)<<SUPERSIZE)-1,
-               align(pdir->pde[i], SUPERSIZE),
-               align(pdir->pde[i], SUPERSIZE) + 0x3fffff);
+               align(pde, SUPERSIZE),
+               align(pde, SUPERSIZE) + (1<<SUPERSIZE)-1);
       } else {
-        struct Ptab* ptab = fromPhys(struct Ptab*,
-                                     align(pdir->pde[i], PAGESIZE));
+        struct Ptab* ptab = fromPhys(struct Ptab*, align(pde, PAGESIZE));
         unsigned base = (i<<SUPERSIZE);
         printf("    [%x-%x] => page table at %x (physical %x):\n",
                base, base + (1<<SUPERSIZE)-1,
-               ptab, align(pdir->pde[i], PAGESIZE));
-        for (unsigned j=0; j<1024; j++) {
-          if (ptab->pte[j] & 1) {
+               ptab, align(pde, PAGESIZE));
+        for (unsigned j=0; j<(1<<PTBITS); j++) {
+          unsigned pte = (unsigned)ptab->pte[j];
+          if (pte & 1) {
             printf("      %x: [%x-%x] => [%x-%x] page\n",
                    j, base+(j<<PAGESIZE), base + ((j+1)<<PAGESIZE) - 1,
-                   align(ptab->pte[j], PAGESIZE),
-                   align(ptab->pte[j], PAGESIZE) + 0xfff);
+                   align(pte, PAGESIZE),
+                   align(pte, PAGESIZE) + 0xfff);
           }
         }
       }
@@ -882,25 +2789,58 @@ void showMapping(unsigned ind, struct Mapping* m) {
     for (unsigned i=0; i<ind; i++) {
       printf(" ");
     }
-    printf("[%x-%x], phys=%x, level=%x, space=%x\n",
-           fpageStart(m->vfp), fpageEnd(m->vfp), m->phys, m->level, m->space);
+    printf("[%x-%x], frame=%x, level=%x, bal=%d, space=%x\n",
+           fpageStart(m->vfp), fpageEnd(m->vfp), m->phys, m->level, m->bal,
+           mappingSpace(m));
     showMapping(ind+1, m->right);
   }
 }
 
+/*-------------------------------------------------------------------------
+ * Run a consistency check on the AVL tree for the memory map of a space,
+ * and on the links from each of its mappings to its neighbors in the
+ * mapping database, returning the height of the tree and adding the
+ * number of mappings in the tree to count.
+ */
+static unsigned checkTree(struct Space* space, struct Mapping* m,
+                          unsigned lo, unsigned hi, unsigned* count) {
+  if (m) {
+    ASSERT(lo<=fpageStart(m->vfp) && fpageEnd(m->vfp)<=hi, "tree order");
+    ASSERT(mappingSpace(m)==space, "tree owner");
+    ASSERT(!m->prev || m->prev->next==m, "mapping list");
+    ASSERT(!m->next || m->next->prev==m, "mapping list");
+    ASSERT(!m->prev || m->level<=m->prev->level+1, "mapping level");
+    unsigned l = checkTree(space, m->left,  lo, fpageStart(m->vfp), count);
+    unsigned r = checkTree(space, m->right, fpageEnd(m->vfp), hi, count);
+    ASSERT((int)(r-l)==m->bal, "tree balance");
+    ++*count;
+    return 1 + max(l, r);
+  }
+  return 0;
+}
+
+unsigned checkSpace(struct Space* space) {
+  unsigned count  = 0;
+  unsigned height = checkTree(space, space->mem, 0, 0xffffffff, &count);
+  printf("Memory map for space %x is balanced, with %d mappings, height %d\n",
+         space, count, height);
+  printf("  %d bytes of kernel memory charged\n", space->used);
+  return count;
+}
+
 /*-------------------------------------------------------------------------
  * Print a description of the current mapping database.
  */
 void showMappingDB() {
-  struct Mapping* m = sigma0Space->mem;
+  struct Mapping* m = rootMapping;
   printf("mapping database, root=%x\n");
   while (m) {
     for (unsigned i=0; i<m->level; i++) {
       printf("  ");
     }
-    printf("%x[%x-%x], phys=%x, level=%x, space=%x, prev=%x, next=%x\n",
+    printf("%x[%x-%x], frame=%x, level=%x, space=%x, prev=%x, next=%x\n",
            m,
-           fpageStart(m->vfp), fpageEnd(m->vfp), m->phys, m->level, m->space,
+           fpageStart(m->vfp), fpageEnd(m->vfp), m->phys, m->level, mappingSpace(m),
            m->prev, m->next);
     m = m->next;
   }
@@ -910,9 +2850,9 @@ void showMappingDB() {
  * Print a description of a space.
  */
 void showSpace(struct Space* space) {
-  printf("address space %x\n", space);
-  printf("  count %d, active %d, loaded %d\n",
-         space->count, space->active, space->loaded);
+  printf("address space %x (asid %x)\n", space, spaceASID(space));
+  printf("  count %d, active %d, used %x of %x\n",
+         space->count, space->active, space->used, getQuota(space));
   printf("  kipArea %x: [%x-%x]\n", space->kipArea,
          fpageStart(space->kipArea), fpageEnd(space->kipArea));
   printf("  utcbArea %x: [%x-%x]\n", space->utcbArea,
@@ -30,25 +30,22 @@
 #define DEBUG(cmd)   /*cmd*/
 
 /*-------------------------------------------------------------------------
- * Thread Directory and Interrupt Thread Data Structures:
+ * Thread Array and Interrupt Thread Data Structures:
  *-----------------------------------------------------------------------*/
-#define TCBDIRBITS 5
-#define TCBPAGES   (1<<(THREADBITS - TCBDIRBITS))
-typedef struct TCB TCBTable[1<<TCBDIRBITS];
-static TCBTable* tcbDir[TCBPAGES];
+#define tcbArray   ((struct TCB*)TCBSPACE)   // TCBs indexed by thread number
 
 /*-------------------------------------------------------------------------
  * Create an executable kernel thread (sigma0 or the root task):
  */
-static struct TCB*  kernelThread5(
- unsigned tno, struct Space* space, unsigned ip) {
+static struct TCB*  kernelThread8(
+ struct Reservation* r, unsigned tno, struct Space* space, unsigned ip) {
   configureSpace(space, fpage(align(PRIV_KIPADDR, PAGESIZE), PAGESIZE),
                         fpage(PRIV_UTCBADDR, PAGESIZE));
   ThreadId tid    = threadId(tno, 1);   // Create new thread:
-  struct TCB* tcb = allocTCB1(tid, space, tid);
+  struct TCB* tcb = allocTCB1(r, tid, space, tid);
   ASSERT(validUtcb(space, PRIV_UTCBADDR), "Invalid kernel thread space");
   tcb->vutcb      = PRIV_UTCBADDR;      // Activate and initialize UTCB
-  tcb->utcb       = allocUtcb4(space, PRIV_UTCBADDR);
+  tcb->utcb       = allocUtcb7(r, space, PRIV_UTCBADDR);
   tcb->utcb->myGlobalId = tid;
   tcb->context.iret.eip = ip;
   insertRunnable(tcb);
@@ -62,58 +59,52 @@ DEBUG(printf("Runnable tcb: tid=%x, utcb=%x, ip=%x\n", tid, PRIV_UTCBADDR, ip);)
  */
 void initTCBs() {
   // Basic consistency checks:
-  ASSERT(sizeof(struct TCB)  <= (1<<(PAGESIZE-TCBDIRBITS)), "TCB size error");
-  ASSERT(sizeof(TCBTable)    == (1<<PAGESIZE), "TCBTable size error");
+  ASSERT(sizeof(struct TCB)  == (1<<TCBSIZE), "TCB size error");
+  ASSERT(TCBSPACE >= KERNEL_SPACE+REALPHYSMAP, "TCB array overlaps window");
   ASSERT(sizeof(struct UTCB) == (1<<UTCBSIZE), "UTCB size error");
 
-  // Initialization of TCB directory: -------------------------------------
-  for (unsigned i=0; i<TCBPAGES; ++i) {
-    tcbDir[i] = 0;
-  }
   initScheduling();
 
   // Construct Sigma0 thread: ---------------------------------------------
-  abortIf(!availPages(5), "Failed to allocate sigma0 thread");
+  struct Reservation r;
+  abortIf(!reservePages(&r, 8), "Failed to allocate sigma0 thread");
 DEBUG(printf("Making Sigma0 tcb:\n");)
   struct TCB* sigma0tcb
-    = kernelThread5(USERBASE, sigma0Space, Sigma0Server.ip);
+    = kernelThread8(&r, USERBASE, sigma0Space, Sigma0Server.ip);
+  releasePages(&r);
 
   // Construct roottask thread: -------------------------------------------
   if (RootServer.ip) {
-    abortIf(!availPages(5), "Failed to allocate root thread");
+    abortIf(!reservePages(&r, 8), "Failed to allocate root thread");
 DEBUG(printf("Making Roottask tcb:\n");)
     struct TCB* roottcb
-      = kernelThread5(USERBASE+1, rootSpace, RootServer.ip);
+      = kernelThread8(&r, USERBASE+1, rootSpace, RootServer.ip);
     roottcb->utcb->pager = sigma0tcb->tid;  // set pager to sigma0 
 DEBUG(printf("roottask, ip=%x, pager=%x\n",RootServer.ip,sigma0tcb->tid);)
+    releasePages(&r);
   }
 
   // Construct IRQ threads: -----------------------------------------------
-  abortIf(!availPages(1+NUMIRQs), "Failed to allocate interrupt threads");
-  struct Space* irqSpace = allocSpace1();
+  abortIf(!reservePages(&r, 1+NUMIRQs), "Failed to allocate interrupt threads");
+  struct Space* irqSpace = allocSpace1(&r);
   for (unsigned i=0; i<NUMIRQs; ++i) {
     ThreadId tid    = threadId(i,1);
-    struct TCB* tcb = allocTCB1(tid, irqSpace, tid);
+    struct TCB* tcb = allocTCB1(&r, tid, irqSpace, tid);
     tcb->vutcb      = tid; // no handler for this interrupt
   }
+  releasePages(&r);
 }
 
 /*-------------------------------------------------------------------------
  * Find a pointer to the tcb for the thread with a given thread number.
- * A null pointer is returned if either (a) there is no memory allocated
- * for the specified tcb; or (b) memory has been allocated but the space
- * field is null.  The latter occurs if the tcb memory was allocated
- * previously to store tcbs for other thread numbers in the same range.
+ * A null pointer is returned if the space field of the tcb is null,
+ * either because the page of the TCB array that would hold the tcb is
+ * not in use (and so reads as zeros), or because other tcbs in the same
+ * page are in use but this one is not.
  */
 struct TCB* existsTCB(unsigned threadNo) {
-  TCBTable* tab = tcbDir[threadNo>>TCBDIRBITS];
-  if (tab) {
-    struct TCB* tcb = ((struct TCB*)tab) + mask(threadNo, TCBDIRBITS);
-    if (tcb->space) {
-      return tcb;
-    }
-  }
-  return 0;
+  struct TCB* tcb = tcbArray + threadNo;
+  return tcb->space ? tcb : 0;
 }
 
 /*-------------------------------------------------------------------------
@@ -132,20 +123,19 @@ struct TCB* findTCB(ThreadId tid) {
  * address space.  We assume that the space is not null and that there is
  * no existing TCB for a thread with the same thread number.
  */
-struct TCB* allocTCB1(ThreadId tid, struct Space* space, ThreadId scheduler) {
-  unsigned    threadNo = threadNo(tid);
-  TCBTable*   tab      = tcbDir[threadNo>>TCBDIRBITS];
-  if (!tab) {
-    tab = tcbDir[threadNo>>TCBDIRBITS] = (TCBTable*)allocPage1();
-  }
-  ++tab[0]->count;  // Count an additional TCB in this page
-  struct TCB* tcb = ((struct TCB*)tab) + mask(threadNo, TCBDIRBITS);
+struct TCB* allocTCB1(struct Reservation* r, ThreadId tid,
+                      struct Space* space, ThreadId scheduler) {
+  struct TCB* tcb   = tcbArray + threadNo(tid);
+  struct TCB* first = (struct TCB*)align((unsigned)tcb, PAGESIZE);
+  allocTCBPage1(r, tcb);
+  ++first->count;   // Count an additional TCB in this page
   tcb->tid        = tid;
   tcb->status     = Halted;
   tcb->space      = space;
   tcb->utcb       = 0;
   tcb->vutcb      = 0xffffffff;
   tcb->sendqueue  = 0;
+  tcb->fpu        = 0;
   tcb->next       = tcb;
   tcb->prev       = tcb;
   tcb->prio       = 128;       // Default is unspecified
@@ -155,6 +145,7 @@ struct TCB* allocTCB1(ThreadId tid, struct Space* space, ThreadId scheduler) {
   tcb->quantleft  = 0;         // Default quantum is infinite
   initUserContext(&(tcb->context));
   enterSpace(space);           // Register the thread in this space
+  chargeSpace(space, sizeof(struct TCB));
   return tcb;
 }
 
@@ -163,8 +154,8 @@ struct TCB* allocTCB1(ThreadId tid, struct Space* space, ThreadId scheduler) {
  * this is the first thread to be activated, creating the initial page
  * directory.
  */
-static void activateTCB4(struct TCB* tcb) {
-  tcb->utcb   = allocUtcb4(tcb->space, tcb->vutcb);
+static void activateTCB7(struct Reservation* r, struct TCB* tcb) {
+  tcb->utcb   = allocUtcb7(r, tcb->space, tcb->vutcb);
   tcb->status = Receiving(Startup); // TODO: run an IPC receive phase here?
   tcb->utcb->exceptionHandler = nilthread;
 }
@@ -172,19 +163,19 @@ static void activateTCB4(struct TCB* tcb) {
 /*-------------------------------------------------------------------------
  * Destroy a TCB, which entails removing it from the corresponding address
  * space; deactivating it if it was active; and, if it was the last valid
- * TCB in the underlying page, deleting the entry from the tcb directory.
+ * TCB in the underlying page, releasing that page of the TCB array.
  */
 static void destroyTCB(struct TCB* tcb) {
   // Register that a TCB has been taken out this space.
+  refundSpace(tcb->space, sizeof(struct TCB));
   exitSpace(tcb->space, tcb->utcb);
   tcb->space = 0; // mark as an empty TCB
 
-  // Test to see if this creates an empty slot in the tcbDir
-  TCBTable* tab = (TCBTable*)align((unsigned)tcb, 12);
-  if (--tab[0]->count==0) {
-DEBUG(printf("Clearing tcbDir slot\n");)
-    tcbDir[(tcb->tid)>>(VERSIONBITS+TCBDIRBITS)] = 0;
-    freePage(tab);
+  // Test to see if this leaves an empty page in the TCB array
+  struct TCB* first = (struct TCB*)align((unsigned)tcb, PAGESIZE);
+  if (--first->count==0) {
+DEBUG(printf("Releasing TCB array page\n");)
+    freeTCBPage(first);
   }
 DEBUG(extern void showRunqueue();)
 DEBUG(showRunqueue();)
@@ -220,22 +211,29 @@ static void createThread() {
     } 
   }
 
-  // Phase 2: Make changes ------------------------------------------------
-  if (!availPages(6)) {                                     // Mem avail?
+  unsigned n = (spaceTCB ? 0 : 1) + 1
+             + ((ThreadControl_PagerId!=nilthread) ? 7 : 0);
+  settleSpace(spaceTCB ? spaceTCB->space : 0, n);
+  struct Reservation r;                                 // Mem avail?
+  if ((!spaceTCB && !availableASID())
+   || !reserveSpace(&r, spaceTCB ? spaceTCB->space : 0, n)) {
     retError(ThreadControl_Result, OUT_OF_MEMORY);
-  } else {
-    struct Space* space = spaceTCB ? spaceTCB->space : allocSpace1();
-    struct TCB* tcb     = allocTCB1(ThreadControl_DestId,
-                                    space,
-                                    ThreadControl_SchedulerId);
-    tcb->vutcb = ThreadControl_UtcbLocation;
-    if (ThreadControl_PagerId!=nilthread) {
-      activateTCB4(tcb);
-      tcb->utcb->myGlobalId = tcb->tid;
-      tcb->utcb->pager      = ThreadControl_PagerId;
-      refreshSpace();   // new utcb mapping might have changed the space
-    }
   }
+
+  // Phase 2: Make changes ------------------------------------------------
+  struct Space* space = spaceTCB ? spaceTCB->space : allocSpace1(&r);
+  struct TCB* tcb     = allocTCB1(&r,
+                                  ThreadControl_DestId,
+                                  space,
+                                  ThreadControl_SchedulerId);
+  tcb->vutcb = ThreadControl_UtcbLocation;
+  if (ThreadControl_PagerId!=nilthread) {
+    activateTCB7(&r, tcb);
+    tcb->utcb->myGlobalId = tcb->tid;
+    tcb->utcb->pager      = ThreadControl_PagerId;
+    refreshSpace();   // new utcb mapping might have changed the space
+  }
+  releasePages(&r);
 }
 
 static void modifyThread(struct TCB* tcb) {
@@ -247,6 +245,9 @@ DEBUG(printf("Kernel:modify thread, vutcb=%x\n", vutcb);)
 DEBUG(printf("Kernel:modify thread, reset to vutcb=%x\n", vutcb);)
   }
 
+  settleSpace(tcb->space,
+              (ThreadControl_PagerId!=nilthread && !tcb->utcb) ? 7 : 0);
+  struct Reservation r = { 0 };
   if (ThreadControl_PagerId!=nilthread && !tcb->utcb) { // Activate reqd
 DEBUG(printf("Kernel:activate required\n");)
     if (!configuredSpace(tcb->space)) {                 // Space config'd?
@@ -255,7 +256,7 @@ DEBUG(printf("Kernel:space not configured\n");)
     } else if (!validUtcb(tcb->space, vutcb)) {         // Valid utcb loc?
 DEBUG(printf("Kernel:invalid utcb location\n");)
       retError(ThreadControl_Result, INVALID_UTCB);
-    } else if (!availPages(4)) {                        // Mem available?
+    } else if (!reserveSpace(&r, tcb->space, 7)) {      // Mem available?
 DEBUG(printf("Kernel:out of memory\n");)
       retError(ThreadControl_Result, OUT_OF_MEMORY);
     }
@@ -273,7 +274,7 @@ DEBUG(printf("Kernel:make changes\n");)
   if (ThreadControl_PagerId!=nilthread) {               // Set/change pager
     if (!tcb->utcb) {                                   // Activate thread
 DEBUG(printf("Kernel: activating thread\n");)
-      activateTCB4(tcb);
+      activateTCB7(&r, tcb);
     }
     tcb->utcb->pager = ThreadControl_PagerId;
   }
@@ -281,11 +282,13 @@ DEBUG(printf("Kernel: activating thread\n");)
   if (tcb->utcb) {
      tcb->utcb->myGlobalId = tcb->tid;
   }
+  releasePages(&r);
 DEBUG(printf("Kernel: DONE modify thread\n");)
 }
 
 static void deleteThread(struct TCB* tcb) {
 DEBUG(printf("Kernel: deleteThread tcb=%x, tid=%x\n", tcb, tcb->tid);)
+  settleSpace(tcb->space, 0); // Make room in the queue of dying spaces
   if (isSending(tcb)) {
 DEBUG(printf("Thread %x was blocked waiting to send\n", tcb->tid);)
     // If this thread was blocked waiting to send, remove it from the
@@ -305,6 +308,7 @@ DEBUG(printf("clearing any threads waiting to send to %x\n", tcb->tid);)
 DEBUG(printf("halting thread %x\n", tcb->tid);)
   haltThread(tcb);
 DEBUG(printf("destroy tcb %x\n", tcb->tid);)
+  releaseFPU(tcb);
   destroyTCB(tcb);
 DEBUG(printf("reschedule!\n", tcb->tid);)
   reschedule();   // (just in case tcb was current or timeslice holder...)
@@ -378,7 +382,36 @@ DEBUG(printf("Kernel:threadControl:done\n");)
 
 /*-------------------------------------------------------------------------
  * The "SpaceControl" System Call:
+ *
+ * If bit 29 of the control parameter is set, then the call clones the
+ * mappings of the (active) space containing the thread in MR0, within the
+ * fpage in MR1, into the (active) destination space, instead of changing
+ * its configuration.  The access rights of the clones are limited to
+ * those in the fpage.  Neither space may be sigma0's, whose page tables
+ * are managed by sigma0map().  This can be preempted, and is then
+ * restarted.
  *-----------------------------------------------------------------------*/
+static void cloneControl(struct Space* dest) {
+  struct TCB* src = findTCB(current->utcb->mr[0]);
+  if (!src
+   || src->space==dest
+   || src->space==sigma0Space
+   || dest==sigma0Space
+   || !activeSpace(src->space)
+   || !activeSpace(dest)) {
+    retError(SpaceControl_Result, INVALID_SPACE);
+  }
+  allowRestart(1);
+  bool ok = cloneSpace(dest, src->space, (Fpage)current->utcb->mr[1]);
+  allowRestart(0);
+  refreshSpace();
+  if (!ok) {
+    retError(SpaceControl_Result, OUT_OF_MEMORY);
+  }
+  SpaceControl_Result = 1;
+  resume();
+}
+
 ENTRY spaceControl() {
   if (!privileged(current->space)) {    /* check for privileged thread   */
     retError(SpaceControl_Result, NO_PRIVILEGE);
@@ -386,34 +419,94 @@ ENTRY spaceControl() {
     struct TCB* dest = findTCB(SpaceControl_SpaceSpecifier);
     if (!dest) {
       retError(SpaceControl_Result, INVALID_SPACE);
+    }
+    settleSpace(dest->space, 0);
+    if (SpaceControl_Control & 0x20000000) {
+      cloneControl(dest->space);
     } else if (!activeSpace(dest->space)) { /* ignore if active threads  */
       Fpage kipArea  = SpaceControl_KipArea;
       Fpage utcbArea = SpaceControl_UtcbArea;
       unsigned kipEnd, utcbEnd;
       if (isNilpage(utcbArea)           /* validate utcb area            */
        || fpageSize(utcbArea)<MIN_UTCBAREASIZE
-       || (utcbEnd=fpageEnd(utcbArea))>=KERNEL_SPACE) {
+       || (utcbEnd=fpageEnd(utcbArea))>=SMALLSPACES) {
         retError(SpaceControl_Result, INVALID_UTCB);
       } else if (isNilpage(kipArea)     /* validate KIP area             */
        || fpageSize(kipArea)!=KIPAREASIZE
-       || (kipEnd=fpageEnd(kipArea))>=KERNEL_SPACE
+       || (kipEnd=fpageEnd(kipArea))>=SMALLSPACES
        || (kipEnd>=fpageStart(utcbArea) && utcbEnd>=fpageStart(kipArea))) {
         retError(SpaceControl_Result, INVALID_KIPAREA);
       } else {
         configureSpace(dest->space, kipArea, utcbArea);
       }
     }
+    /* The control parameter has the following layout:                */
+    /*   bit  31    set the quota from bits 0-27;                     */
+    /*   bit  30    place the space in a small space slot;            */
+    /*   bit  29    clone mappings instead (see cloneControl());      */
+    /*   bit  28    return the space to a large address space;        */
+    /*   bits 0-27  limit on the number of pages of kernel memory     */
+    /*              that can be charged to the space.                 */
+    /* If neither bit 30 nor bit 28 is set, then the space keeps its  */
+    /* current small space setting.  The previous quota is returned.  */
+    unsigned control = SpaceControl_Control;
+    unsigned quota   = getQuota(dest->space);
+    if (control & 0x40000000) {
+      setSmall(dest->space, 1);
+    } else if (control & 0x10000000) {
+      setSmall(dest->space, 0);
+    }
+    if (control & 0x80000000) {
+      control &= 0x0fffffff;
+      setQuota(dest->space,
+               (control < (1<<(32-PAGESIZE))) ? (control<<PAGESIZE) : ~0);
+    }
     SpaceControl_Result      = 1;
-    SpaceControl_Control     = 0;   /* control parameter is not used */
+    SpaceControl_Control     = quota >> PAGESIZE;
     resume();
   }
 }
 
 /*-------------------------------------------------------------------------
  * The "Unmap" System Call:
+ *
+ * An Unmap can be preempted part way through (see preemptionPoint()).
+ * In that case, the index of the fpage that was being processed is saved
+ * in bits 7-12 of the control word, which are always zero when the system
+ * call is first made, and bit 13 is set to indicate that edx (which the
+ * system call may clobber) holds the status bits that had already been
+ * collected for that fpage when the operation was interrupted.
+ *
+ * Unmapping part of a larger mapping in the caller's own space may need
+ * kernel memory to split it.  If that would take the space over its
+ * quota, then the Unmap stops at that fpage, which is returned as a nil
+ * fpage, with OUT_OF_MEMORY in the ErrorCode; the fpages that follow it
+ * are left unchanged.
  *-----------------------------------------------------------------------*/
+#define UNMAP_RESTART (1<<13)
+
 ENTRY unmap() {
-  /* TODO: implement this system call. */
+  unsigned  k   = mask(Unmap_Control, 6);    /* fpages are in MR0..MRk */
+  bool      own = (Unmap_Control>>6) & 1;    /* f bit: flush own space */
+  unsigned  i   = mask(Unmap_Control>>7, 6); /* (nonzero on a restart) */
+  unsigned* mr  = current->utcb->mr;
+  if (!(Unmap_Control & UNMAP_RESTART)) {
+    Unmap_Status = 0;
+  }
+  allowRestart(1);
+  for (; i<=k; i++) {
+    Unmap_Control = mask(Unmap_Control, 7) | (i<<7) | UNMAP_RESTART;
+    if (!revokeFpage(current->space, (Fpage)mr[i], own, &Unmap_Status)) {
+      mr[i] = 0;
+      current->utcb->errorCode = OUT_OF_MEMORY;
+      break;
+    }
+    mr[i]        = ((Fpage)mr[i] & ~(R|W|X)) | Unmap_Status;
+    Unmap_Status = 0;
+  }
+  allowRestart(0);
+  Unmap_Control = mask(Unmap_Control, 7);
+  refreshSpace();   /* one TLB flush (at most) for the whole batch */
   resume();
 }
 
@@ -20,7 +20,6 @@
 #ifndef L4_MESSAGE_H
 #define L4_MESSAGE_H
 #include <l4/types.h>
-#include <l4/space.h>
 #include <l4/utcb.h>
 
 /* Message Registers: ---------------------------------------------------*/
@@ -45,4 +44,6 @@ static inline void L4_LoadMRs(int i, int k, L4_Word_t* w) {
   }
 }
 
+#include <l4/space.h>   /* after the MR functions, which space.h uses */
+
 #endif
@@ -28,6 +28,13 @@ EXTERNC(L4_Word_t L4_MemoryControl(L4_Word_t control,
 
 #define L4_DefaultMemory    0
 
+/* pork extensions, for use by sigma0 only: move the pages in an fpage in
+ * to (L4_KernelMemory) or out of (L4_ReclaimMemory) the kernel's free
+ * list.  The number of pages moved is returned in MR0.
+ */
+#define L4_KernelMemory     (~1UL)
+#define L4_ReclaimMemory    (~2UL)
+
 static inline L4_Word_t L4_Set_PageAttribute(L4_Fpage_t f,
                                              L4_Word_t attribute) {
   L4_Word_t attributes[4];
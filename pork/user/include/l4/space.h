@@ -21,6 +21,7 @@
 #define L4_SPACE_H
 #include <l4/types.h>
 #include <l4/thread.h>
+#include <l4/message.h>
 
 EXTERNC(L4_Word_t L4_SpaceControl(
 			L4_ThreadId_t spaceSpec,
@@ -29,6 +30,51 @@ EXTERNC(L4_Word_t L4_SpaceControl(
 			L4_Fpage_t utcbArea,
 			L4_Word_t* oldControl))
 
+EXTERNC(void L4_Unmap(L4_Word_t control))
+
+/* Unmap (or, for L4_Flush, also remove from the caller's own space) the
+ * rights specified in each fpage.  On return, the R and W bits of each
+ * fpage indicate whether its pages have been referenced or written.
+ */
+static inline L4_Fpage_t L4_UnmapFpage(L4_Fpage_t f) {
+  L4_LoadMR(0, f.raw);
+  L4_Unmap(0);
+  L4_StoreMR(0, &f.raw);
+  return f;
+}
+
+static inline L4_Fpage_t L4_Flush(L4_Fpage_t f) {
+  L4_LoadMR(0, f.raw);
+  L4_Unmap(0x40);
+  L4_StoreMR(0, &f.raw);
+  return f;
+}
+
+static inline void L4_UnmapFpages(L4_Word_t n, L4_Fpage_t* fpages) {
+  L4_LoadMRs(0, n, (L4_Word_t*)fpages);
+  L4_Unmap(n-1);
+  L4_StoreMRs(0, n, (L4_Word_t*)fpages);
+}
+
+static inline void L4_FlushFpages(L4_Word_t n, L4_Fpage_t* fpages) {
+  L4_LoadMRs(0, n, (L4_Word_t*)fpages);
+  L4_Unmap(0x40|(n-1));
+  L4_StoreMRs(0, n, (L4_Word_t*)fpages);
+}
+
+/* Clone the mappings of the space containing src, within the fpage f,
+ * into the space containing dest, with their access rights limited to
+ * those in f.  (A pork extension of SpaceControl, which is only available
+ * to privileged threads.)
+ */
+static inline L4_Word_t L4_CloneSpace(L4_ThreadId_t dest,
+                                      L4_ThreadId_t src, L4_Fpage_t f) {
+  L4_Word_t old;
+  L4_LoadMR(0, src.raw);
+  L4_LoadMR(1, f.raw);
+  return L4_SpaceControl(dest, 0x20000000, L4_Nilpage, L4_Nilpage, &old);
+}
+
 #if defined(__cplusplus)
 /* This is a hack to "handle" the alternative version of
    SpaceControl that includes an additional redirector
@@ -210,6 +210,40 @@ L4_SpaceControl:
 	popl	%esi
 	ret				# result is in %eax 
 
+	# -----------------------------------------------------------------
+	# void L4_Unmap			// On entry:	mr0..mrk->
+	#  (L4_Word_t control)		//  4(%esp)	->eax
+	#				// On exit:	mr0..mrk<-
+
+	.global	L4_Unmap
+L4_Unmap:
+	movl	4(%esp), %eax		# control
+	int	$0x76			# TODO: should indirect via KIP ...
+	ret
+
+	# -----------------------------------------------------------------
+	# L4_Word_t L4_MemoryControl	// On entry:	mr0..mrt->
+	#  // ebx, ebp, return addr	// -- 12 bytes
+	#  (L4_Word_t control,		// 12(%esp)	->eax
+	#   L4_Word_t attribute[4])	// 16(%esp)	->ecx,edx,ebx,ebp
+
+	.global	L4_MemoryControl
+L4_MemoryControl:
+	pushl	%ebx
+	pushl	%ebp
+
+	movl	12(%esp), %eax		# control
+	movl	16(%esp), %ebp		# attribute array
+	movl	(%ebp), %ecx		# attribute[0]
+	movl	4(%ebp), %edx		# attribute[1]
+	movl	8(%ebp), %ebx		# attribute[2]
+	movl	12(%ebp), %ebp		# attribute[3]
+	int	$0x78			# TODO: should indirect via KIP ...
+
+	popl	%ebp
+	popl	%ebx
+	ret				# result is in %eax
+
 	# -----------------------------------------------------------------
 	# (use Prim version to avoid returning a structure type)
 	# L4_Word_t L4_Prim_Ipc			// On entry:	mr0->
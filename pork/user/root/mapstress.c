@@ -0,0 +1,168 @@
+/*
+    Copyright 2014-2018 Mark P Jones, Portland State University
+
+    This file is part of CEMLaBS/LLP Demos and Lab Exercises.
+
+    CEMLaBS/LLP Demos and Lab Exercises is free software: you can
+    redistribute it and/or modify it under the terms of the GNU General
+    Public License as published by the Free Software Foundation, either
+    version 3 of the License, or (at your option) any later version.
+
+    CEMLaBS/LLP Demos and Lab Exercises is distributed in the hope that
+    it will be useful, but WITHOUT ANY WARRANTY; without even the
+    implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+    PURPOSE.  See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CEMLaBS/LLP Demos and Lab Exercises.  If not, see
+    <https://www.gnu.org/licenses/>.
+*/
+/* A stress test for the mapping database: the root task acts as the pager
+ * for a thread in a new address space, which touches STRESSMAPS distinct
+ * pages, each of which is mapped from the same page in the root task, and
+ * then flushes them again.  After each phase, the root task asks the kernel
+ * to check the AVL tree and mapping database links for the new space, and
+ * prints the number of cycles that the phase took.  Finally, the root task
+ * deletes the thread, and hence the space.  This is done twice, once with
+ * the pages in sequential order and once in a scrambled order.  The kernel
+ * must be built with KDB for the check.
+ */
+#include "simpleio.h"
+#include <l4/space.h>
+#include <l4/thread.h>
+#include <l4/ipc.h>
+
+typedef unsigned long long u64;
+extern u64 tsc();
+
+#ifndef STRESSMAPS
+#define STRESSMAPS  100000      // Number of pages to map in each round
+#endif
+#define STRESSBASE  0x10000000  // Start of the window for those pages
+#define STRESSSTEP  7919        // Prime step to scramble the page order
+#define STRESSQUOTA 1024        // Kernel memory quota for the new space
+
+#define INSERTED    1           // Labels for reports at the end of a phase
+#define REMOVED     2
+
+L4_ThreadId_t stressId;
+int           stressScrambled;  // Shared with the thread via root's pages
+unsigned char stressPage[4096]  __attribute__((aligned(4096)));
+unsigned char stressStack[4096] __attribute__((aligned(4096)));
+
+static L4_Word_t stressAddr(L4_Word_t i, int scrambled) {
+  return STRESSBASE
+       + ((scrambled ? (i*STRESSSTEP) % STRESSMAPS : i) << 12);
+}
+
+/*-------------------------------------------------------------------------
+ * Ask the kernel to check the memory map of the space containing tid,
+ * returning the number of mappings in the space.  This uses the L4Ka
+ * kernel debugger convention of an int3 followed by a cmpb instruction.
+ */
+#define KDB_CHECKSPACE 0x20
+
+static L4_Word_t checkSpace(L4_ThreadId_t tid) {
+  L4_Word_t count;
+  asm volatile("  int3\n"
+               "  cmpb %2, %%al\n"
+               : "=a"(count) : "a"(tid.raw), "i"(KDB_CHECKSPACE) : "memory");
+  return count;
+}
+
+/*-------------------------------------------------------------------------
+ * The thread in the new space, which reports to its pager (the root task)
+ * at the end of each phase:
+ */
+static void stressReport(L4_Word_t label) {
+  L4_LoadMR(0, label<<16);   // tag: label, no words
+  L4_Call(L4_Pager());
+}
+
+static void stressThread() {
+  for (L4_Word_t i=0; i<STRESSMAPS; i++) {
+    (void)*(volatile unsigned char*)stressAddr(i, stressScrambled);
+  }
+  stressReport(INSERTED);
+  for (L4_Word_t i=0; i<STRESSMAPS; i++) {
+    L4_Flush(L4_FpageAddRights(L4_FpageLog2(stressAddr(i, stressScrambled),
+                                            12),
+                               L4_FullyAccessible));
+  }
+  stressReport(REMOVED);
+  for (;;) {
+    L4_Receive(L4_nilthread);
+  }
+}
+
+/*-------------------------------------------------------------------------
+ * Run one round of the test, acting as the pager for the new thread until
+ * it is done:
+ */
+static void stressPhase(char* name, u64 cycles, L4_Word_t count, int ok) {
+  printf("mapstress: %s %d pages in %d Kcycles (%d per page), "
+         "%d mappings: %s\n",
+         name, STRESSMAPS, (unsigned)(cycles>>10),
+         (unsigned)(cycles>>4) / (STRESSMAPS>>4), // STRESSMAPS%16==0
+         count, ok ? "ok" : "FAILED");
+}
+
+static void stressRound(int scrambled) {
+  L4_Word_t control;
+  stressScrambled = scrambled;
+  stressId        = L4_GlobalId(300+scrambled, 1);
+  L4_ThreadControl(stressId, stressId, L4_Myself(), L4_nilthread, (void*)-1);
+  L4_SpaceControl(stressId, 0x80000000|STRESSQUOTA,
+                  L4_FpageLog2(0x100000, 12), L4_FpageLog2(0x200000, 12),
+                  &control);
+  L4_ThreadControl(stressId, stressId, L4_nilthread, L4_Myself(),
+                   (void*)0x200000);
+  L4_Start_SpIpFlags(stressId, (L4_Word_t)stressStack + sizeof(stressStack),
+                     (L4_Word_t)stressThread, 0);
+
+  L4_ThreadId_t from;
+  L4_MsgTag_t   tag   = L4_Receive(stressId);
+  L4_Word_t     count = 0;
+  u64           mark  = tsc();
+  for (;;) {
+    if (L4_IpcSucceeded(tag) && L4_UntypedWords(tag)==2
+     && (tag.raw>>20)==0xffe) {
+      L4_Word_t addr;
+      L4_StoreMR(1, &addr);
+      addr &= ~0xfff;
+      L4_Word_t page = addr;              // Map the same page everywhere
+      if (STRESSBASE<=addr && addr<stressAddr(STRESSMAPS, 0)) {
+        page = (L4_Word_t)stressPage;
+      } else {
+        (void)*(volatile unsigned char*)page;  // Fault in our own copy
+      }
+      L4_LoadMR(0, 2<<6);                 // tag: 2 words of typed items
+      L4_LoadMR(1, addr | 8);             // MapItem
+      L4_LoadMR(2, L4_FpageLog2(page, 12).raw | L4_FullyAccessible);
+    } else if (L4_IpcSucceeded(tag) && L4_Label(tag)==INSERTED) {
+      u64 cycles = tsc() - mark;
+      count = checkSpace(stressId);
+      stressPhase("inserted", cycles, count, count>=STRESSMAPS);
+      L4_LoadMR(0, 0);                    // tag: Empty message
+      mark = tsc();
+    } else if (L4_IpcSucceeded(tag) && L4_Label(tag)==REMOVED) {
+      u64 cycles = tsc() - mark;
+      L4_Word_t previous = count;
+      count = checkSpace(stressId);
+      stressPhase("removed", cycles, count, count+STRESSMAPS<=previous);
+      break;
+    }
+    tag = L4_ReplyWait(stressId, &from);
+  }
+
+  L4_ThreadControl(stressId, L4_nilthread, L4_nilthread, L4_nilthread,
+                   (void*)-1);                // Delete the thread and space
+}
+
+void mapStress() {
+  for (unsigned i=0; i<4096; i++) {     // Ensure that our own pages are
+    stressPage[i] = stressStack[i] = 0; // mapped before we map them on
+  }
+  stressRound(0);
+  stressRound(1);
+}
@@ -24,6 +24,9 @@
 #include <l4/thread.h>
 #include <l4/schedule.h>
 #include <l4/ipc.h>
+#include <l4/kip.h>
+#include <l4/misc.h>
+#include "kip.h"
 #include "hardware.h"
 
 extern unsigned readTSC(unsigned* hi);
@@ -143,6 +146,9 @@ void startPing() {
 }
 #endif
 
+#define SPACEQUOTA 64         // Limit on pages of kernel memory for a new space
+#define SMALLSPACE 0x40000000 // Request a small address space
+
 void spawn(char* name,
            L4_ThreadId_t tid,
            L4_Word_t     utcbNo,
@@ -166,7 +172,8 @@ void spawn(char* name,
   if (tid.raw==spaceSpec.raw) {
     L4_Word_t control;
     printf("configured space for %s -> %x\n", name,
-     L4_SpaceControl(tid, 0, L4_FpageLog2(0x100000, 12),
+     L4_SpaceControl(tid, 0x80000000|SMALLSPACE|SPACEQUOTA,
+                             L4_FpageLog2(0x100000, 12),
                              L4_FpageLog2(utcb, 12), &control));
     printf("Error code is %x, control=%x\n", L4_ErrorCode(), control);
   } else {
@@ -184,6 +191,47 @@ void spawn(char* name,
   printf("thread %s (tid %x) is now running\n", name, tid);
 }
 
+#ifdef TESTS
+/* Exercise the kernel memory protocol: ask sigma0 to donate a page of
+ * conventional memory to the kernel, and then to reclaim it, checking that
+ * one page moves each way.  We use the last page of the highest region of
+ * conventional memory within the kernel's window on physical memory; the
+ * kernel takes its own memory from the lowest regions at boot.
+ */
+#define KERNELWINDOW 0x20000000   // Kernel only uses memory below 512MB
+
+L4_Word_t kernelMemoryRPC(L4_Word_t page, L4_Word_t attribute) {
+  L4_Word_t count = 0;
+  L4_LoadMR(0, (0xffa0<<16) | 2);  // tag: label -6<<4, 2 untyped words
+  L4_LoadMR(1, L4_FpageLog2(page, 12).raw);
+  L4_LoadMR(2, attribute);
+  L4_MsgTag_t tag = L4_Call(L4_Pager());
+  if (L4_IpcSucceeded(tag) && L4_UntypedWords(tag)==1) {
+    L4_StoreMR(1, &count);
+  }
+  return count;
+}
+
+void testKernelMemory() {
+  struct KernelInterface* kip
+      = (struct KernelInterface*)L4_GetKernelInterface();
+  struct MemDesc* mem  = (struct MemDesc*)((kip->memoryInfo>>16)
+                                           + (unsigned)kip);
+  unsigned        page = 0;
+  for (unsigned i=0; i<(kip->memoryInfo & 0xffff); i++) {
+    unsigned hi = mem[i].hi | 0x3ff;    // Type 1 is conventional, physical
+    if ((mem[i].lo & 0x3ff)==1 && hi<KERNELWINDOW && hi>page) {
+      page = hi & ~0xfff;
+    }
+  }
+  L4_Word_t donated   = kernelMemoryRPC(page, L4_KernelMemory);
+  L4_Word_t reclaimed = kernelMemoryRPC(page, L4_ReclaimMemory);
+  printf("kernel memory at %x: donated %d, reclaimed %d: %s\n",
+         page, donated, reclaimed,
+         (donated==1 && reclaimed==1) ? "ok" : "FAILED");
+}
+#endif
+
 void cmain() {
   setWindow(10, 14, 41, 39);
   setAttr(0x5);
@@ -192,6 +240,11 @@ void cmain() {
 
   extern void showKIP();
   showKIP();
+#ifdef TESTS
+  testKernelMemory();
+  extern void mapStress();
+  mapStress();
+#endif
 
   ping = L4_GlobalId(100,1);
   pong = L4_GlobalId(200,1);
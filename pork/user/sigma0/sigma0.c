@@ -23,8 +23,37 @@
 #include "l4.h"
 #include <l4/thread.h>
 #include <l4/ipc.h>
+#include <l4/misc.h>
 #include "kip.h"
 
+/* On each page fault, we map the faulting page and also offer the rest of
+ * the naturally aligned block of 2^FAULTAROUND bytes that contains it, as
+ * one map item for each of the buddies of the faulting page (of sizes 4K,
+ * 8K, ...).  The kernel only installs these extra items where the faulting
+ * space has no mappings, so they never replace anything that is already
+ * there.
+ */
+#define FAULTAROUND 16
+
+/* Handle a kernel memory request from the root server, which sends the
+ * fpage in MR1 and either L4_KernelMemory (to donate the pages in the
+ * fpage to the kernel) or L4_ReclaimMemory (to return any idle kernel
+ * pages in the fpage) in MR2.  The reply holds the number of pages moved.
+ */
+void kernelMemoryRequest() {
+  L4_Word_t fpage, attributes[4], count = 0;
+  L4_StoreMR(1, &fpage);
+  L4_StoreMR(2, &attributes[0]);
+  if (attributes[0]==L4_KernelMemory || attributes[0]==L4_ReclaimMemory) {
+    L4_LoadMR(0, fpage & ~0x3);  // use attribute[0]
+    if (L4_MemoryControl(0, attributes)) {
+      L4_StoreMR(0, &count);
+    }
+  }
+  L4_LoadMR(0, 1);               // tag: 1 untyped word
+  L4_LoadMR(1, count);
+}
+
 void cmain() {
   setWindow(10, 14, 0, 39);
   setAttr(0x3);
@@ -48,9 +77,23 @@ void cmain() {
       L4_StoreMR(1, &mr1);
       L4_StoreMR(2, &mr2);
     printf("pagefault %x, mr1=%x, mr2=%x\n", from, mr1, mr2);
-      L4_LoadMR(0, (2<<6));   // tag: 2 words of typed items
-      L4_LoadMR(1, (mr1 & ~0xfff) | 8); // MapItem
-      L4_LoadMR(2, L4_FpageLog2(mr1, 12).raw | L4_FullyAccessible); 
+      L4_Word_t addr = mr1 & ~0xfff;
+      L4_Word_t i    = 2;
+      L4_LoadMR(1, addr | 8); // MapItem
+      L4_LoadMR(2, L4_FpageLog2(addr, 12).raw | L4_FullyAccessible);
+      for (int size=12; size<FAULTAROUND; size++) {
+        L4_Word_t buddy = (addr ^ (1<<size)) & ~((1<<size)-1);
+        L4_LoadMR(++i, buddy | 8); // MapItem
+        L4_LoadMR(++i, L4_FpageLog2(buddy, size).raw | L4_FullyAccessible);
+      }
+      L4_LoadMR(0, (i<<6));   // tag: i words of typed items
+      tag = L4_ReplyWait(from, &from);
+    } else if (L4_IpcSucceeded(tag)    &&
+               L4_UntypedWords(tag)==2 &&
+               L4_TypedWords(tag)  ==0 &&
+               (tag.raw>>20)==0xffa    &&
+               L4_ThreadNo(from)==L4_ThreadNo(L4_Myself())+1) {
+      kernelMemoryRequest();     // sigma0 RPC from the root server
       tag = L4_ReplyWait(from, &from);
     } else {
       printf("Ignoring message/failure, trying again ...\n");